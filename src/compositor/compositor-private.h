@@ -57,6 +57,24 @@ struct _MetaCompositor
                              MetaWindow     *window);
   void (*unmaximize_window) (MetaCompositor *compositor,
                              MetaWindow     *window);
+
+  GVariant *(* get_frame_stats) (MetaCompositor *compositor,
+                                 guint           since);
+
+  void (*set_show_redraw) (MetaCompositor *compositor,
+                           gboolean        show);
+
+  gboolean (*run_effect) (MetaCompositor       *compositor,
+                          MetaWindow           *window,
+                          MetaCompositorEffect  effect,
+                          MetaRectangle        *window_rect,
+                          MetaRectangle        *icon_rect);
+
+  gboolean (*set_outline) (MetaCompositor      *compositor,
+                           MetaScreen          *screen,
+                           const MetaRectangle *rect,
+                           int                  cols,
+                           int                  rows);
 };
 
 #endif
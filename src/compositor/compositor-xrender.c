@@ -34,12 +34,14 @@
 
 #include <gdk/gdk.h>
 #include <cairo/cairo-xlib.h>
+#include <cairo/cairo-xlib-xrender.h>
 
 #include "display.h"
 #include "screen.h"
 #include "frame.h"
 #include "errors.h"
 #include "window.h"
+#include "screen-private.h"
 #include "compositor-private.h"
 #include "compositor-xrender.h"
 #include "xprops.h"
@@ -49,11 +51,25 @@
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/Xrender.h>
+#ifdef HAVE_RANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef HAVE_PRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
 
 #include "deepin-message-hub.h"
 
 #define USE_IDLE_REPAINT 1
 
+/* Refresh rate used when the X server can't tell us one (Xvfb, nested
+   servers, ...) */
+#define FALLBACK_REFRESH_RATE 60
+
+/* Smallest head start, in microseconds, a repaint gets before the vblank
+   it is aimed at */
+#define MIN_FRAME_BUDGET 2000
+
 typedef enum _MetaCompWindowType
 {
   META_COMP_WINDOW_NORMAL,
@@ -73,6 +89,34 @@ typedef enum _MetaShadowType
   LAST_SHADOW_TYPE
 } MetaShadowType;
 
+/* Number of frames the statistics are kept for */
+#define FRAME_STATS_HISTORY 512
+
+#ifdef HAVE_PRESENT
+/* Pixmaps a screen paints its frames into and hands to the server with
+   XPresentPixmap. Each one only needs the damage of the frames painted
+   since it was last used, which is also how far back the damage is kept */
+#define BACK_BUFFER_COUNT 3
+
+typedef struct _MetaBackBuffer
+{
+  Pixmap pixmap;
+  Picture picture;
+  guint64 frame;  /* Frame last painted into it, 0 if it holds nothing */
+  gboolean busy;  /* Presented and not released by the server yet */
+} MetaBackBuffer;
+#endif
+
+typedef struct _MetaFrameStats
+{
+  gint64 paint_time;
+  guint64 damaged_area;
+  guint64 culled_area;
+  guint windows_painted;
+  gulong requests;
+  gboolean late;
+} MetaFrameStats;
+
 typedef struct _MetaCompositorXRender
 {
   MetaCompositor compositor;
@@ -95,12 +139,44 @@ typedef struct _MetaCompositorXRender
   Atom atom_net_wm_window_type_toolbar;
   Atom atom_net_wm_window_type_dropdown_menu;
   Atom atom_net_wm_window_type_tooltip;
+  Atom atom_net_wm_bypass_compositor;
 
 #ifdef USE_IDLE_REPAINT
   guint repaint_id;
-  guint fps;
-  guint use_idle_paint: 1;
+
+  /* Frame clock, all times in microseconds on the monotonic clock. Each
+     output keeps its own vblanks, see MetaCompOutput; frame_interval is
+     the shortest of their intervals and target_vblank the vblank the
+     frame being painted is aimed at */
+  gint64 frame_interval;
+  gint64 frame_budget;
+  gint64 paint_time;
+  gint64 target_vblank;
+  gint64 repaint_deadline;
+
+  /* Set while a frame is being repaired, damage found then is painted
+     by that frame and needs no repaint of its own */
+  gboolean repairing;
 #endif
+#ifdef HAVE_PRESENT
+  int present_opcode;
+  guint have_present : 1;
+#endif
+
+  /* Ring buffer of the last frames painted, n_frames keeps counting
+     past FRAME_STATS_HISTORY */
+  MetaFrameStats frame_stats[FRAME_STATS_HISTORY];
+  guint n_frames;
+  guint n_late_frames;
+
+  /* Server side objects made for windows so far */
+  guint64 pixmaps_named;
+  guint64 pictures_created;
+  guint64 shadows_created;
+
+  /* ShapeNotify events that turned out not to change anything */
+  guint64 shapes_unchanged;
+
   guint enabled : 1;
   guint show_redraw : 1;
   guint debug : 1;
@@ -119,6 +195,50 @@ typedef struct _shadow
   guchar *shadow_top;
 } shadow;
 
+/* Number of opacity steps the presummed shadow tables are built for */
+#define SHADOW_OPACITY_STEPS 25
+
+/* Redraw heatmap: size of its tiles, heat a tile gains each time it is
+   repainted (out of 255) and number of colours it is drawn with */
+#define HEATMAP_TILE 32
+#define HEATMAP_HEAT 96
+#define HEATMAP_LEVELS 8
+
+/* Opacity steps of the shared alpha pictures, as many as the A8 format
+   can tell apart */
+#define ALPHA_PICTURE_STEPS 255
+
+/* Pre-rendered nine-slice pieces of a shadow. The corners are read out of
+   a small (2 * size + 1) square template, the edges and the centre are one
+   pixel thick repeating pictures that get stretched to any window size on
+   the server, so resizing a window never needs new shadow pixels. */
+typedef struct _MetaShadowTiles
+{
+  int size;
+  Picture corners;
+  Picture top;
+  Picture bottom;
+  Picture left;
+  Picture right;
+  Picture centre;
+} MetaShadowTiles;
+
+#ifdef USE_IDLE_REPAINT
+/* A monitor of the screen. Its damage is painted on the deadlines of its
+   own refresh, so a busy output doesn't make the others repaint and
+   outputs at different rates each get their own cadence */
+typedef struct _MetaCompOutput
+{
+  MetaRectangle rect;
+  cairo_region_t *damage;
+
+  gint64 frame_interval;
+  gint64 last_vblank;
+  gint64 target_vblank; /* 0 while no frame is scheduled */
+  gint64 last_target_vblank;
+} MetaCompOutput;
+#endif
+
 typedef struct _MetaCompScreen
 {
   MetaScreen *screen;
@@ -131,21 +251,95 @@ typedef struct _MetaCompScreen
 
   gboolean have_shadows;
   shadow *shadows[LAST_SHADOW_TYPE];
+  MetaShadowTiles *shadow_tiles[LAST_SHADOW_TYPE][SHADOW_OPACITY_STEPS + 1];
 
   Picture root_picture;
   Picture root_buffer;
   Picture black_picture;
   Picture trans_black_picture;
+
+  /* Shared 1x1 repeating pictures, see get_alpha_picture and
+     get_solid_picture. They belong to the screen, not to the windows */
+  Picture alpha_pictures[ALPHA_PICTURE_STEPS + 1];
+  GHashTable *solid_pictures;
   Picture root_tile;
-  XserverRegion all_damage;
+  cairo_region_t *all_damage;
+
+#ifdef USE_IDLE_REPAINT
+  /* The Xinerama screens, all_damage only gathers their damage for the
+     frame being painted */
+  MetaCompOutput *outputs;
+  int n_outputs;
+#endif
 
   guint overlays;
   gboolean compositor_active;
   gboolean clip_changed;
 
   GSList *dock_windows;
+
+  /* Window the server currently draws straight to the screen */
+  struct _MetaCompWindow *unredirected;
+  gboolean allow_unredirect;
+
+  /* Set whenever the stacking or geometry of the windows changes, the
+     occlusion of each window is then rebuilt on the next damage */
+  gboolean occlusion_dirty;
+
+  /* Area, in pixels, of the window damage seen and of the part of it
+     that was dropped because opaque windows cover it */
+  guint64 damage_area;
+  guint64 culled_area;
+  guint64 frame_culled_area;
+
+  guint windows_painted;
+
+  /* Windows that got a DamageNotify since the last frame */
+  GSList *pending_repairs;
+
+  /* MetaCompAnimations running, painted above every window */
+  GList *animations;
+
+  /* Outline of the window being moved or resized in reduced resources
+     mode, and the label in it for the size it would get, if any */
+  gboolean have_outline;
+  cairo_rectangle_int_t outline;
+  Picture outline_label;
+  int outline_label_width;
+  int outline_label_height;
+  int outline_label_cols;
+  int outline_label_rows;
+
+  /* Heat of each HEATMAP_TILE square of the screen while show_redraw is
+     on, and whether any of it is left to fade out */
+  guchar *heat;
+  int heat_cols;
+  int heat_rows;
+  gboolean heat_warm;
+
+#ifdef HAVE_PRESENT
+  XID present_event;
+
+  /* Frames are presented from back_buffers instead of being copied from
+     root_buffer when use_back_buffers is set. damage_history holds the
+     damage of the last frames, indexed by frame number */
+  gboolean use_back_buffers;
+  MetaBackBuffer back_buffers[BACK_BUFFER_COUNT];
+  cairo_region_t *damage_history[BACK_BUFFER_COUNT];
+  guint64 present_frame;
+#endif
 } MetaCompScreen;
 
+/* How far back_pixmap and picture can be trusted. The server gives a
+   window a new pixmap each time it is mapped or resized; the old one
+   keeps the last contents, which is what an unmapped window shows */
+typedef enum
+{
+  PIXMAP_NONE,    /* nothing named, the picture (if any) is on the window */
+  PIXMAP_CURRENT, /* back_pixmap is the one the window is drawn to */
+  PIXMAP_STALE    /* mapped again since, rename on the next paint */
+} MetaPixmapState;
+
 typedef struct _MetaCompWindow
 {
   MetaScreen *screen;
@@ -154,6 +348,7 @@ typedef struct _MetaCompWindow
   XWindowAttributes attrs;
 
   Pixmap back_pixmap;
+  MetaPixmapState pixmap_state;
 
   /* When the window is shaded back_pixmap will be replaced with the pixmap
      for the shaded window. This is a copy of the original unshaded window
@@ -168,6 +363,12 @@ typedef struct _MetaCompWindow
 
   XRectangle shape_bounds;
 
+  /* Bounding shape rectangles relative to the window as last fetched,
+     so that a client setting the same shape again can be spotted */
+  XRectangle *shape_rects;
+  int n_shape_rects;
+  gboolean shape_rects_valid;
+
   MetaCompWindowType type;
 
   Damage damage;
@@ -176,11 +377,17 @@ typedef struct _MetaCompWindow
 
   gboolean needs_shadow;
   MetaShadowType shadow_type;
+
+  /* Docks only: the shadow already composited into an ARGB picture, so
+     painting it takes a single composite without a mask. Goes with
+     shadow, which is rebuilt on resize and opacity changes */
   Picture shadow_pict;
 
-  XserverRegion border_size;
-  XserverRegion window_size;
-  XserverRegion extents;
+  /* Regions are kept client side so that the per-frame clip
+     computations in paint_windows() don't cost any X requests */
+  cairo_region_t *border_size;
+  cairo_region_t *window_size;
+  cairo_region_t *extents;
 
   Picture shadow;
   int shadow_dx;
@@ -190,17 +397,70 @@ typedef struct _MetaCompWindow
 
   guint opacity;
 
-  XserverRegion border_clip;
+  cairo_region_t *border_clip;
+
+  /* Union of the opaque windows stacked above this one. Windows with
+     the same occluders share a reference to the same region */
+  cairo_region_t *occlusion;
 
   gboolean updates_frozen;
   gboolean update_pending;
+
+  guint bypass_compositor;
+  gboolean unredirected;
+
+  /* Queued in pending_repairs, its damage is fetched with the next frame */
+  gboolean repair_pending;
+
+  /* An animation shows the window instead, see MetaCompAnimation */
+  gboolean animating;
 } MetaCompWindow;
 
+/* Length of the minimize, unminimize and close animations, in
+   microseconds */
+#define ANIMATION_LENGTH 250000
+
+/* Move/resize outline: width of its border, and font size and padding
+   of the size label in its middle */
+#define OUTLINE_WIDTH 3
+#define OUTLINE_LABEL_FONT_SIZE 14
+#define OUTLINE_LABEL_PADDING 4
+
+/* A window being minimized, unminimized or closed. The animation holds
+   its own picture of the window pixmap, so it keeps going once the
+   window is unmapped or destroyed */
+typedef struct _MetaCompAnimation
+{
+  Window id;
+  MetaCompositorEffect effect;
+
+  Picture picture;
+  int width;
+  int height;
+
+  /* Where the window is at full size and where it shrinks to */
+  MetaRectangle window_rect;
+  MetaRectangle icon_rect;
+
+  gint64 start;
+  gint64 length;
+  double progress;
+
+  /* Painted by the last frame, damaged again by the next */
+  cairo_rectangle_int_t rect;
+  double opacity;
+} MetaCompAnimation;
+
 #define OPAQUE 0xffffffff
 
 #define WINDOW_SOLID 0
 #define WINDOW_ARGB 1
 
+/* Values of _NET_WM_BYPASS_COMPOSITOR */
+#define BYPASS_COMPOSITOR_NO_PREFERENCE 0
+#define BYPASS_COMPOSITOR_REQUESTED 1
+#define BYPASS_COMPOSITOR_FORBIDDEN 2
+
 #define SHADOW_SMALL_RADIUS 3.0
 #define SHADOW_MEDIUM_RADIUS 6.0
 #define SHADOW_LARGE_RADIUS 12.0
@@ -265,37 +525,39 @@ make_gaussian_map (double r)
 }
 
 static void
-dump_xserver_region (const char   *location,
-                     MetaDisplay  *display,
-                     XserverRegion region)
+dump_region (const char     *location,
+             MetaDisplay    *display,
+             cairo_region_t *region)
 {
   MetaCompositorXRender *compositor = DISPLAY_COMPOSITOR (display);
-  Display *xdisplay = meta_display_get_xdisplay (display);
-  int nrects;
-  XRectangle *rects;
-  XRectangle bounds;
+  int n_rects;
 
   if (!compositor->debug)
     return;
 
   if (region)
     {
-      rects = XFixesFetchRegionAndBounds (xdisplay, region, &nrects, &bounds);
-      if (nrects > 0)
+      n_rects = cairo_region_num_rectangles (region);
+      if (n_rects > 0)
         {
+          cairo_rectangle_int_t bounds, rect;
           int i;
-          fprintf (stderr, "%s (XSR): %d rects, bounds: %d,%d (%d,%d)\n",
-                   location, nrects, bounds.x, bounds.y, bounds.width, bounds.height);
-          for (i = 1; i < nrects; i++)
-            fprintf (stderr, "\t%d,%d (%d,%d)\n",
-                     rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+
+          cairo_region_get_extents (region, &bounds);
+          fprintf (stderr, "%s: %d rects, bounds: %d,%d (%d,%d)\n",
+                   location, n_rects, bounds.x, bounds.y, bounds.width, bounds.height);
+          for (i = 0; i < n_rects; i++)
+            {
+              cairo_region_get_rectangle (region, i, &rect);
+              fprintf (stderr, "\t%d,%d (%d,%d)\n",
+                       rect.x, rect.y, rect.width, rect.height);
+            }
         }
       else
-        fprintf (stderr, "%s (XSR): empty\n", location);
-      XFree (rects);
+        fprintf (stderr, "%s: empty\n", location);
     }
   else
-    fprintf (stderr, "%s (XSR): null\n", location);
+    fprintf (stderr, "%s: null\n", location);
 }
 
 /*
@@ -384,41 +646,43 @@ presum_gaussian (shadow *shad)
   if (shad->shadow_top)
     g_free (shad->shadow_top);
 
-  shad->shadow_corner = (guchar *)(g_malloc ((msize + 1) * (msize + 1) * 26));
-  shad->shadow_top = (guchar *) (g_malloc ((msize + 1) * 26));
+  shad->shadow_corner = (guchar *)(g_malloc ((msize + 1) * (msize + 1) * (SHADOW_OPACITY_STEPS + 1)));
+  shad->shadow_top = (guchar *) (g_malloc ((msize + 1) * (SHADOW_OPACITY_STEPS + 1)));
 
   for (x = 0; x <= msize; x++)
     {
 
-      shad->shadow_top[25 * (msize + 1) + x] =
+      shad->shadow_top[SHADOW_OPACITY_STEPS * (msize + 1) + x] =
         sum_gaussian (map, 1, x - centre, centre, msize * 2, msize * 2);
-      for (opacity = 0; opacity < 25; opacity++)
+      for (opacity = 0; opacity < SHADOW_OPACITY_STEPS; opacity++)
         {
           shad->shadow_top[opacity * (msize + 1) + x] =
-            shad->shadow_top[25 * (msize + 1) + x] * opacity / 25;
+            shad->shadow_top[SHADOW_OPACITY_STEPS * (msize + 1) + x] * opacity
+            / SHADOW_OPACITY_STEPS;
         }
 
       for (y = 0; y <= x; y++)
         {
-          shad->shadow_corner[25 * (msize + 1) * (msize + 1)
+          shad->shadow_corner[SHADOW_OPACITY_STEPS * (msize + 1) * (msize + 1)
                               + y * (msize + 1)
                               + x]
             = sum_gaussian (map, 1, x - centre, y - centre,
                             msize * 2, msize * 2);
 
-          shad->shadow_corner[25 * (msize + 1) * (msize + 1)
+          shad->shadow_corner[SHADOW_OPACITY_STEPS * (msize + 1) * (msize + 1)
                               + x * (msize + 1) + y] =
-            shad->shadow_corner[25 * (msize + 1) * (msize + 1)
+            shad->shadow_corner[SHADOW_OPACITY_STEPS * (msize + 1) * (msize + 1)
                                 + y * (msize + 1) + x];
 
-          for (opacity = 0; opacity < 25; opacity++)
+          for (opacity = 0; opacity < SHADOW_OPACITY_STEPS; opacity++)
             {
               shad->shadow_corner[opacity * (msize + 1) * (msize + 1)
                                   + y * (msize + 1) + x]
                 = shad->shadow_corner[opacity * (msize + 1) * (msize + 1)
                                       + x * (msize + 1) + y]
-                = shad->shadow_corner[25 * (msize + 1) * (msize + 1)
-                                      + y * (msize + 1) + x] * opacity / 25;
+                = shad->shadow_corner[SHADOW_OPACITY_STEPS * (msize + 1) * (msize + 1)
+                                      + y * (msize + 1) + x] * opacity
+                / SHADOW_OPACITY_STEPS;
             }
         }
     }
@@ -462,7 +726,7 @@ make_shadow (MetaDisplay   *display,
   int x, y;
   guchar d;
   int x_diff;
-  int opacity_int = (int)(opacity * 25);
+  int opacity_int = (int)(opacity * SHADOW_OPACITY_STEPS);
   int screen_number = meta_screen_get_screen_number (screen);
 
   if (info==NULL)
@@ -575,18 +839,17 @@ double shadow_offsets_y[LAST_SHADOW_TYPE] = {SHADOW_SMALL_OFFSET_Y,
                                              SHADOW_MEDIUM_OFFSET_Y,
                                              SHADOW_LARGE_OFFSET_Y};
 
-static XserverRegion
-cairo_region_to_xserver_region (Display        *xdisplay,
-                                cairo_region_t *region)
+static XRectangle *
+cairo_region_to_xrectangles (cairo_region_t *region,
+                             int            *n_rects)
 {
-  int n_rects, i;
   XRectangle *rects;
-  XserverRegion xregion;
+  int i;
 
-  n_rects = cairo_region_num_rectangles (region);
-  rects = g_new (XRectangle, n_rects);
+  *n_rects = cairo_region_num_rectangles (region);
+  rects = g_new (XRectangle, *n_rects);
 
-  for (i = 0; i < n_rects; i++)
+  for (i = 0; i < *n_rects; i++)
     {
       cairo_rectangle_int_t rect;
 
@@ -598,10 +861,94 @@ cairo_region_to_xserver_region (Display        *xdisplay,
       rects[i].height = rect.height;
     }
 
-  xregion = XFixesCreateRegion (xdisplay, rects, n_rects);
-  g_free (rects);
+  return rects;
+}
+
+static cairo_region_t *
+xrectangles_to_cairo_region (XRectangle *rects,
+                             int         n_rects)
+{
+  cairo_rectangle_int_t *crects;
+  cairo_region_t *region;
+  int i;
+
+  if (rects == NULL || n_rects <= 0)
+    return cairo_region_create ();
+
+  crects = g_new (cairo_rectangle_int_t, n_rects);
+
+  for (i = 0; i < n_rects; i++)
+    {
+      crects[i].x = rects[i].x;
+      crects[i].y = rects[i].y;
+      crects[i].width = rects[i].width;
+      crects[i].height = rects[i].height;
+    }
+
+  region = cairo_region_create_rectangles (crects, n_rects);
+  g_free (crects);
+
+  return region;
+}
+
+static cairo_region_t *
+xserver_region_to_cairo_region (Display       *xdisplay,
+                                XserverRegion  xregion)
+{
+  XRectangle *rects;
+  cairo_region_t *region;
+  int n_rects;
+
+  rects = XFixesFetchRegion (xdisplay, xregion, &n_rects);
+  region = xrectangles_to_cairo_region (rects, n_rects);
+
+  if (rects)
+    XFree (rects);
+
+  return region;
+}
+
+/* Number of pixels covered by @region */
+static guint64
+region_area (cairo_region_t *region)
+{
+  guint64 area = 0;
+  int i, n_rects;
+
+  n_rects = cairo_region_num_rectangles (region);
+  for (i = 0; i < n_rects; i++)
+    {
+      cairo_rectangle_int_t rect;
+
+      cairo_region_get_rectangle (region, i, &rect);
+      area += (guint64) rect.width * rect.height;
+    }
+
+  return area;
+}
 
-  return xregion;
+/* Sets the clip of @picture straight from a client side region, this is a
+   single request and doesn't need a server side region to be created */
+static void
+set_picture_clip_region (Display        *xdisplay,
+                         Picture         picture,
+                         cairo_region_t *region)
+{
+  XRectangle *rects;
+  int n_rects;
+
+  if (region == NULL)
+    {
+      XRenderPictureAttributes pa;
+
+      pa.clip_mask = None;
+      XRenderChangePicture (xdisplay, picture, CPClipMask, &pa);
+      return;
+    }
+
+  rects = cairo_region_to_xrectangles (region, &n_rects);
+  XRenderSetPictureClipRectangles (xdisplay, picture, 0, 0, rects, n_rects);
+  g_free (rects);
 }
 
 static void
@@ -615,9 +962,9 @@ shadow_picture_clip (Display          *xdisplay,
   int shadow_dx;
   int shadow_dy;
   cairo_region_t *visible_region;
-  XRectangle rect;
-  XserverRegion region1;
-  XserverRegion region2;
+  cairo_rectangle_int_t rect;
+  cairo_region_t *region1;
+  cairo_region_t *region2;
 
   if (cw->attrs.map_state == IsUnmapped || !cw->window)
     return;
@@ -635,17 +982,212 @@ shadow_picture_clip (Display          *xdisplay,
   rect.width = width;
   rect.height = height;
 
-  region1 = XFixesCreateRegion (xdisplay, &rect, 1);
-  region2 = cairo_region_to_xserver_region (xdisplay, visible_region);
+  region1 = cairo_region_create_rectangle (&rect);
+  region2 = cairo_region_copy (visible_region);
+
+  cairo_region_translate (region2, shadow_dx, shadow_dy);
+
+  cairo_region_subtract (region1, region2);
+  set_picture_clip_region (xdisplay, shadow_picture, region1);
+
+  cairo_region_destroy (region1);
+  cairo_region_destroy (region2);
+}
+
+static Picture
+create_alpha_picture (Display *xdisplay,
+                      Window   xroot,
+                      int      width,
+                      int      height,
+                      gboolean repeat)
+{
+  Pixmap pixmap;
+  Picture picture;
+  XRenderPictureAttributes pa;
+
+  pixmap = XCreatePixmap (xdisplay, xroot, width, height, 8);
+  if (!pixmap)
+    return None;
+
+  pa.repeat = repeat;
+  picture = XRenderCreatePicture (xdisplay, pixmap,
+                                  XRenderFindStandardFormat (xdisplay, PictStandardA8),
+                                  CPRepeat, &pa);
+  XFreePixmap (xdisplay, pixmap);
+
+  return picture;
+}
+
+static Picture
+upload_shadow_image (Display *xdisplay,
+                     Window   xroot,
+                     XImage  *shadow_image)
+{
+  Pixmap shadow_pixmap;
+  Picture shadow_picture;
+  GC gc;
+
+  shadow_pixmap = XCreatePixmap (xdisplay, xroot,
+                                 shadow_image->width, shadow_image->height, 8);
+  if (!shadow_pixmap)
+    return None;
+
+  shadow_picture = XRenderCreatePicture (xdisplay, shadow_pixmap,
+                                         XRenderFindStandardFormat (xdisplay, PictStandardA8),
+                                         0, 0);
+  if (!shadow_picture)
+    {
+      XFreePixmap (xdisplay, shadow_pixmap);
+      return None;
+    }
+
+  gc = XCreateGC (xdisplay, shadow_pixmap, 0, 0);
+  if (!gc)
+    {
+      XFreePixmap (xdisplay, shadow_pixmap);
+      XRenderFreePicture (xdisplay, shadow_picture);
+      return None;
+    }
+
+  XPutImage (xdisplay, shadow_pixmap, gc, shadow_image, 0, 0, 0, 0,
+             shadow_image->width, shadow_image->height);
+
+  XFreeGC (xdisplay, gc);
+  XFreePixmap (xdisplay, shadow_pixmap);
+
+  return shadow_picture;
+}
+
+static void
+free_shadow_tiles (Display         *xdisplay,
+                   MetaShadowTiles *tiles)
+{
+  Picture pictures[] = { tiles->corners, tiles->top, tiles->bottom,
+                         tiles->left, tiles->right, tiles->centre };
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (pictures); i++)
+    {
+      if (pictures[i] != None)
+        XRenderFreePicture (xdisplay, pictures[i]);
+    }
+
+  g_free (tiles);
+}
+
+/* Returns the cached nine-slice tiles for this shadow type and opacity,
+   rendering and uploading them the first time they are needed. The
+   opacity is quantized the same way the presummed tables are, so the
+   tiles are pixel identical to what make_shadow() produces. */
+static MetaShadowTiles *
+get_shadow_tiles (MetaDisplay    *display,
+                  MetaScreen     *screen,
+                  MetaShadowType  shadow_type,
+                  double          opacity)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  Window xroot = meta_screen_get_xroot (screen);
+  MetaShadowTiles *tiles;
+  XImage *shadow_image;
+  int opacity_int;
+  int msize;
+
+  if (info == NULL || info->shadows[shadow_type] == NULL)
+    return NULL;
+
+  opacity_int = CLAMP ((int) (opacity * SHADOW_OPACITY_STEPS), 0, SHADOW_OPACITY_STEPS);
+
+  tiles = info->shadow_tiles[shadow_type][opacity_int];
+  if (tiles != NULL)
+    return tiles;
+
+  /* A window one pixel larger than the kernel gives a template whose
+     corners are complete and whose edges are a single pixel thick */
+  msize = info->shadows[shadow_type]->gaussian_map->size;
+  shadow_image = make_shadow (display, screen, shadow_type,
+                              (double) opacity_int / SHADOW_OPACITY_STEPS,
+                              msize + 1, msize + 1);
+  if (!shadow_image)
+    return NULL;
+
+  tiles = g_new0 (MetaShadowTiles, 1);
+  tiles->size = msize;
+  tiles->corners = upload_shadow_image (xdisplay, xroot, shadow_image);
+  XDestroyImage (shadow_image);
+
+  tiles->top = create_alpha_picture (xdisplay, xroot, 1, msize, TRUE);
+  tiles->bottom = create_alpha_picture (xdisplay, xroot, 1, msize, TRUE);
+  tiles->left = create_alpha_picture (xdisplay, xroot, msize, 1, TRUE);
+  tiles->right = create_alpha_picture (xdisplay, xroot, msize, 1, TRUE);
+  tiles->centre = create_alpha_picture (xdisplay, xroot, 1, 1, TRUE);
+
+  if (!tiles->corners || !tiles->top || !tiles->bottom ||
+      !tiles->left || !tiles->right || !tiles->centre)
+    {
+      free_shadow_tiles (xdisplay, tiles);
+      return NULL;
+    }
+
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, tiles->top,
+                    msize, 0, 0, 0, 0, 0, 1, msize);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, tiles->bottom,
+                    msize, msize + 1, 0, 0, 0, 0, 1, msize);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, tiles->left,
+                    0, msize, 0, 0, 0, 0, msize, 1);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, tiles->right,
+                    msize + 1, msize, 0, 0, 0, 0, msize, 1);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, tiles->centre,
+                    msize, msize, 0, 0, 0, 0, 1, 1);
 
-  XFixesTranslateRegion (xdisplay, region2,
-                         shadow_dx, shadow_dy);
+  info->shadow_tiles[shadow_type][opacity_int] = tiles;
 
-  XFixesSubtractRegion (xdisplay, region1, region1, region2);
-  XFixesSetPictureClipRegion (xdisplay, shadow_picture, 0, 0, region1);
+  return tiles;
+}
+
+/* Assembles a shadow mask of any size from the cached tiles. Everything
+   happens on the server, no pixels are generated or transferred. */
+static Picture
+tiled_shadow_picture (Display         *xdisplay,
+                      Window           xroot,
+                      MetaShadowTiles *tiles,
+                      int              swidth,
+                      int              sheight)
+{
+  Picture picture;
+  int m = tiles->size;
+  int inner_width = swidth - 2 * m;
+  int inner_height = sheight - 2 * m;
+
+  picture = create_alpha_picture (xdisplay, xroot, swidth, sheight, FALSE);
+  if (!picture)
+    return None;
+
+  /* corners */
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, picture,
+                    0, 0, 0, 0, 0, 0, m, m);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, picture,
+                    m + 1, 0, 0, 0, swidth - m, 0, m, m);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, picture,
+                    0, m + 1, 0, 0, 0, sheight - m, m, m);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->corners, None, picture,
+                    m + 1, m + 1, 0, 0, swidth - m, sheight - m, m, m);
+
+  /* edges */
+  XRenderComposite (xdisplay, PictOpSrc, tiles->top, None, picture,
+                    0, 0, 0, 0, m, 0, inner_width, m);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->bottom, None, picture,
+                    0, 0, 0, 0, m, sheight - m, inner_width, m);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->left, None, picture,
+                    0, 0, 0, 0, 0, m, m, inner_height);
+  XRenderComposite (xdisplay, PictOpSrc, tiles->right, None, picture,
+                    0, 0, 0, 0, swidth - m, m, m, inner_height);
+
+  /* centre */
+  XRenderComposite (xdisplay, PictOpSrc, tiles->centre, None, picture,
+                    0, 0, 0, 0, m, m, inner_width, inner_height);
 
-  XFixesDestroyRegion (xdisplay, region1);
-  XFixesDestroyRegion (xdisplay, region2);
+  return picture;
 }
 
 static Picture
@@ -660,55 +1202,51 @@ shadow_picture (MetaDisplay      *display,
                 int              *hp)
 {
   Display *xdisplay = meta_display_get_xdisplay (display);
+  MetaShadowTiles *tiles;
   XImage *shadow_image;
-  Pixmap shadow_pixmap;
   Picture shadow_picture;
   Window xroot = meta_screen_get_xroot (screen);
-  GC gc;
+
+  /* Windows larger than the kernel are built from the tile cache, only
+     tiny ones still get their shadow rendered on the client */
+  tiles = get_shadow_tiles (display, screen, cw->shadow_type, opacity);
+  if (tiles && width > tiles->size && height > tiles->size)
+    {
+      int swidth = width + tiles->size;
+      int sheight = height + tiles->size;
+
+      shadow_picture = tiled_shadow_picture (xdisplay, xroot, tiles,
+                                             swidth, sheight);
+      if (shadow_picture)
+        {
+          shadow_picture_clip (xdisplay, shadow_picture, cw, borders,
+                               swidth, sheight);
+          *wp = swidth;
+          *hp = sheight;
+
+          return shadow_picture;
+        }
+    }
 
   shadow_image = make_shadow (display, screen, cw->shadow_type,
                               opacity, width, height);
   if (!shadow_image)
     return None;
 
-  shadow_pixmap = XCreatePixmap (xdisplay, xroot,
-                                 shadow_image->width, shadow_image->height, 8);
-  if (!shadow_pixmap)
-    {
-      XDestroyImage (shadow_image);
-      return None;
-    }
-
-  shadow_picture = XRenderCreatePicture (xdisplay, shadow_pixmap,
-                                         XRenderFindStandardFormat (xdisplay, PictStandardA8),
-                                         0, 0);
+  shadow_picture = upload_shadow_image (xdisplay, xroot, shadow_image);
   if (!shadow_picture)
     {
       XDestroyImage (shadow_image);
-      XFreePixmap (xdisplay, shadow_pixmap);
       return None;
     }
 
   shadow_picture_clip (xdisplay, shadow_picture, cw, borders,
                        shadow_image->width, shadow_image->height);
 
-  gc = XCreateGC (xdisplay, shadow_pixmap, 0, 0);
-  if (!gc)
-    {
-      XDestroyImage (shadow_image);
-      XFreePixmap (xdisplay, shadow_pixmap);
-      XRenderFreePicture (xdisplay, shadow_picture);
-      return None;
-    }
-
-  XPutImage (xdisplay, shadow_pixmap, gc, shadow_image, 0, 0, 0, 0,
-             shadow_image->width, shadow_image->height);
   *wp = shadow_image->width;
   *hp = shadow_image->height;
 
-  XFreeGC (xdisplay, gc);
   XDestroyImage (shadow_image);
-  XFreePixmap (xdisplay, shadow_pixmap);
 
   return shadow_picture;
 }
@@ -803,31 +1341,111 @@ solid_picture (MetaDisplay *display,
   return picture;
 }
 
+/* Returns the screen's A8 picture for opacity, creating it on first use,
+   so changing the opacity of a window costs nothing on the server */
 static Picture
-root_tile (MetaScreen *screen)
+get_alpha_picture (MetaScreen *screen,
+                   double      opacity)
 {
-  MetaDisplay *display = meta_screen_get_display (screen);
-  Display *xdisplay = meta_display_get_xdisplay (display);
-  Picture picture;
-  Pixmap pixmap;
-  gboolean free_pixmap;
-  gboolean fill;
-  XRenderPictureAttributes pa;
-  XRenderPictFormat *format;
-  int p;
-  Atom background_atoms[2];
-  Atom pixmap_atom;
-  int screen_number = meta_screen_get_screen_number (screen);
-  Window xroot = meta_screen_get_xroot (screen);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  int opacity_int;
 
-  pixmap = None;
-  free_pixmap = FALSE;
-  fill = FALSE;
+  opacity_int = CLAMP ((int) (opacity * ALPHA_PICTURE_STEPS + 0.5),
+                       0, ALPHA_PICTURE_STEPS);
 
-  background_atoms[0] = DISPLAY_COMPOSITOR (display)->atom_x_root_pixmap;
-  background_atoms[1] = DISPLAY_COMPOSITOR (display)->atom_x_set_root;
+  if (info->alpha_pictures[opacity_int] == None)
+    info->alpha_pictures[opacity_int] =
+      solid_picture (meta_screen_get_display (screen), screen, FALSE,
+                     (double) opacity_int / ALPHA_PICTURE_STEPS, 0, 0, 0);
 
-  pixmap_atom = XInternAtom (xdisplay, "PIXMAP", False);
+  return info->alpha_pictures[opacity_int];
+}
+
+/* Same for ARGB colours, keyed by the colour rounded to 8 bits a channel */
+static Picture
+get_solid_picture (MetaScreen *screen,
+                   double      a,
+                   double      r,
+                   double      g,
+                   double      b)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  guint key;
+  Picture picture;
+
+  a = CLAMP (a, 0.0, 1.0);
+  r = CLAMP (r, 0.0, 1.0);
+  g = CLAMP (g, 0.0, 1.0);
+  b = CLAMP (b, 0.0, 1.0);
+
+  key = ((guint) (a * 255 + 0.5) << 24) | ((guint) (r * 255 + 0.5) << 16) |
+        ((guint) (g * 255 + 0.5) << 8) | (guint) (b * 255 + 0.5);
+
+  picture = (Picture) g_hash_table_lookup (info->solid_pictures,
+                                           GUINT_TO_POINTER (key));
+  if (picture != None)
+    return picture;
+
+  picture = solid_picture (meta_screen_get_display (screen), screen, TRUE,
+                           (double) (key >> 24) / 255,
+                           (double) ((key >> 16) & 0xff) / 255,
+                           (double) ((key >> 8) & 0xff) / 255,
+                           (double) (key & 0xff) / 255);
+  if (picture != None)
+    g_hash_table_insert (info->solid_pictures, GUINT_TO_POINTER (key),
+                         (gpointer) picture);
+
+  return picture;
+}
+
+static void
+free_solid_pictures (MetaScreen *screen)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  Display *xdisplay = meta_display_get_xdisplay (meta_screen_get_display (screen));
+  GHashTableIter iter;
+  gpointer picture;
+  int i;
+
+  for (i = 0; i <= ALPHA_PICTURE_STEPS; i++)
+    {
+      if (info->alpha_pictures[i] != None)
+        XRenderFreePicture (xdisplay, info->alpha_pictures[i]);
+      info->alpha_pictures[i] = None;
+    }
+
+  g_hash_table_iter_init (&iter, info->solid_pictures);
+  while (g_hash_table_iter_next (&iter, NULL, &picture))
+    XRenderFreePicture (xdisplay, (Picture) picture);
+  g_hash_table_destroy (info->solid_pictures);
+  info->solid_pictures = NULL;
+}
+
+static Picture
+root_tile (MetaScreen *screen)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  Picture picture;
+  Pixmap pixmap;
+  gboolean free_pixmap;
+  gboolean fill;
+  XRenderPictureAttributes pa;
+  XRenderPictFormat *format;
+  int p;
+  Atom background_atoms[2];
+  Atom pixmap_atom;
+  int screen_number = meta_screen_get_screen_number (screen);
+  Window xroot = meta_screen_get_xroot (screen);
+
+  pixmap = None;
+  free_pixmap = FALSE;
+  fill = FALSE;
+
+  background_atoms[0] = DISPLAY_COMPOSITOR (display)->atom_x_root_pixmap;
+  background_atoms[1] = DISPLAY_COMPOSITOR (display)->atom_x_set_root;
+
+  pixmap_atom = XInternAtom (xdisplay, "PIXMAP", False);
   for (p = 0; p < 2; p++)
     {
       Atom actual_type;
@@ -1047,13 +1665,12 @@ window_has_shadow (MetaCompWindow *cw)
 }
 
 
-static XserverRegion
+static cairo_region_t *
 win_extents (MetaCompWindow *cw)
 {
   MetaScreen *screen = cw->screen;
   MetaDisplay *display = meta_screen_get_display (screen);
-  Display *xdisplay = meta_display_get_xdisplay (display);
-  XRectangle r;
+  cairo_rectangle_int_t r;
 
   r.x = cw->attrs.x;
   r.y = cw->attrs.y;
@@ -1063,7 +1680,7 @@ win_extents (MetaCompWindow *cw)
   if (cw->needs_shadow)
     {
       MetaFrameBorders borders;
-      XRectangle sr;
+      cairo_rectangle_int_t sr;
 
       meta_frame_borders_clear (&borders);
 
@@ -1091,6 +1708,7 @@ win_extents (MetaCompWindow *cw)
                                        cw->attrs.width - invisible_width + cw->attrs.border_width * 2,
                                        cw->attrs.height - invisible_height + cw->attrs.border_width * 2,
                                        &cw->shadow_width, &cw->shadow_height);
+          DISPLAY_COMPOSITOR (display)->shadows_created++;
         }
 
       sr.x = cw->attrs.x + cw->shadow_dx;
@@ -1117,61 +1735,123 @@ win_extents (MetaCompWindow *cw)
         r.height = sr.y + sr.height - r.y;
     }
 
-  return XFixesCreateRegion (xdisplay, &r, 1);
+  return cairo_region_create_rectangle (&r);
 }
 
-static XserverRegion
-border_size (MetaCompWindow *cw)
+static void
+free_shape_rects (MetaCompWindow *cw)
 {
-  MetaScreen *screen = cw->screen;
-  MetaDisplay *display = meta_screen_get_display (screen);
+  if (cw->shape_rects)
+    XFree (cw->shape_rects);
+
+  cw->shape_rects = NULL;
+  cw->n_shape_rects = 0;
+  cw->shape_rects_valid = FALSE;
+}
+
+/* Fetches the bounding shape of the window into cw->shape_rects, and
+   returns whether it is any different from the one cached before */
+static gboolean
+fetch_shape_rects (MetaCompWindow *cw)
+{
+  MetaDisplay *display = meta_screen_get_display (cw->screen);
   Display *xdisplay = meta_display_get_xdisplay (display);
-  XserverRegion border;
+  XRectangle *rects;
+  int n_rects, ordering;
+  gboolean changed;
 
   meta_error_trap_push (display);
-  border = XFixesCreateRegionFromWindow (xdisplay, cw->id,
-                                         WindowRegionBounding);
+  rects = XShapeGetRectangles (xdisplay, cw->id, ShapeBounding,
+                               &n_rects, &ordering);
   meta_error_trap_pop (display, FALSE);
 
-  g_return_val_if_fail (border != None, None);
-  XFixesTranslateRegion (xdisplay, border,
-                         cw->attrs.x + cw->attrs.border_width,
-                         cw->attrs.y + cw->attrs.border_width);
+  if (rects == NULL)
+    n_rects = 0;
+
+  changed = (!cw->shape_rects_valid || n_rects != cw->n_shape_rects ||
+             (n_rects > 0 &&
+              memcmp (rects, cw->shape_rects, n_rects * sizeof (XRectangle)) != 0));
+
+  if (changed)
+    {
+      free_shape_rects (cw);
+      cw->shape_rects = rects;
+      cw->n_shape_rects = n_rects;
+      cw->shape_rects_valid = TRUE;
+    }
+  else if (rects)
+    XFree (rects);
+
+  return changed;
+}
+
+/* The bounding region of the window in root coordinates. Unshaped windows
+   are a plain rectangle and need no X request at all, shaped windows need
+   one round trip to fetch their shape unless it is cached already. The
+   result is kept in cw->border_size until the window is resized or
+   reshaped; moves just translate it. */
+static cairo_region_t *
+border_size (MetaCompWindow *cw)
+{
+  cairo_region_t *border;
+
+  if (cw->shaped)
+    {
+      if (!cw->shape_rects_valid)
+        fetch_shape_rects (cw);
+
+      border = xrectangles_to_cairo_region (cw->shape_rects,
+                                            cw->n_shape_rects);
+    }
+  else
+    {
+      cairo_rectangle_int_t r;
+
+      r.x = -cw->attrs.border_width;
+      r.y = -cw->attrs.border_width;
+      r.width = cw->attrs.width + cw->attrs.border_width * 2;
+      r.height = cw->attrs.height + cw->attrs.border_width * 2;
+
+      border = cairo_region_create_rectangle (&r);
+    }
+
+  cairo_region_translate (border,
+                          cw->attrs.x + cw->attrs.border_width,
+                          cw->attrs.y + cw->attrs.border_width);
 
   return border;
 }
 
-static XserverRegion
+static cairo_region_t *
 window_size (MetaCompWindow *cw)
 {
-  MetaScreen *screen = cw->screen;
-  MetaDisplay *display = meta_screen_get_display (screen);
-  Display *xdisplay = meta_display_get_xdisplay (display);
   cairo_region_t *visible_region;
-  XserverRegion visible = None;
-  XserverRegion border;
+  cairo_region_t *visible;
+  cairo_region_t *border;
+
+  /* Derived from the cached border region so shaped windows don't
+     have their shape fetched twice */
+  if (cw->border_size == NULL)
+    cw->border_size = border_size (cw);
+
+  border = cairo_region_copy (cw->border_size);
 
-  
   if (cw->attrs.map_state != IsUnmapped && cw->window)
     {
       visible_region = meta_window_get_frame_bounds (cw->window);
 
       if (visible_region)
-        visible = cairo_region_to_xserver_region (xdisplay, visible_region);
-    }
-
-  border = border_size (cw);
-
-  if (visible != None && border != None)
-    {
-      XFixesTranslateRegion (xdisplay, visible,
-                         cw->attrs.x + cw->attrs.border_width,
-                         cw->attrs.y + cw->attrs.border_width);
+        {
+          visible = cairo_region_copy (visible_region);
+          cairo_region_translate (visible,
+                                  cw->attrs.x + cw->attrs.border_width,
+                                  cw->attrs.y + cw->attrs.border_width);
 
-      XFixesIntersectRegion (xdisplay, visible, visible, border);
-      XFixesDestroyRegion (xdisplay, border);
+          cairo_region_intersect (visible, border);
+          cairo_region_destroy (border);
 
-      return visible;
+          return visible;
+        }
     }
 
   return border;
@@ -1209,12 +1889,17 @@ get_window_picture (MetaCompWindow *cw)
   meta_error_trap_push (display);
 
   if (cw->back_pixmap == None)
-    cw->back_pixmap = XCompositeNameWindowPixmap (xdisplay, cw->id);
+    {
+      cw->back_pixmap = XCompositeNameWindowPixmap (xdisplay, cw->id);
+      DISPLAY_COMPOSITOR (display)->pixmaps_named++;
+    }
 
   error_code = meta_error_trap_pop_with_return (display, FALSE);
   if (error_code != 0)
     cw->back_pixmap = None;
 
+  cw->pixmap_state = cw->back_pixmap != None ? PIXMAP_CURRENT : PIXMAP_NONE;
+
   if (cw->back_pixmap != None)
     draw = cw->back_pixmap;
 
@@ -1229,6 +1914,8 @@ get_window_picture (MetaCompWindow *cw)
       pict = XRenderCreatePicture (xdisplay, draw, format, CPSubwindowMode, &pa);
       meta_error_trap_pop (display, FALSE);
 
+      DISPLAY_COMPOSITOR (display)->pictures_created++;
+
       return pict;
     }
 
@@ -1236,431 +1923,1926 @@ get_window_picture (MetaCompWindow *cw)
 }
 
 static void
-paint_dock_shadows (MetaScreen   *screen,
-                    Picture       root_buffer,
-                    XserverRegion region)
+free_window_pixmap (MetaCompWindow *cw)
 {
-  MetaDisplay *display = meta_screen_get_display (screen);
+  MetaDisplay *display = meta_screen_get_display (cw->screen);
   Display *xdisplay = meta_display_get_xdisplay (display);
-  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
-  GSList *d;
 
-  if (info == NULL)
+  if (cw->picture)
     {
-      return;
+      XRenderFreePicture (xdisplay, cw->picture);
+      cw->picture = None;
     }
 
-  for (d = info->dock_windows; d; d = d->next)
+  if (cw->back_pixmap)
     {
-      MetaCompWindow *cw = d->data;
-      XserverRegion shadow_clip;
+      XFreePixmap (xdisplay, cw->back_pixmap);
+      cw->back_pixmap = None;
+    }
 
-      if (cw->shadow)
-        {
-          shadow_clip = XFixesCreateRegion (xdisplay, NULL, 0);
-          XFixesIntersectRegion (xdisplay, shadow_clip,
-                                 cw->border_clip, region);
+  cw->pixmap_state = PIXMAP_NONE;
+}
 
-          XFixesSetPictureClipRegion (xdisplay, root_buffer, 0, 0, shadow_clip);
+static void
+free_window_shadow (MetaCompWindow *cw)
+{
+  MetaDisplay *display = meta_screen_get_display (cw->screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
 
-          XRenderComposite (xdisplay, PictOpOver, info->black_picture,
-                            cw->shadow, root_buffer,
-                            0, 0, 0, 0,
-                            cw->attrs.x + cw->shadow_dx,
-                            cw->attrs.y + cw->shadow_dy,
-                            cw->shadow_width, cw->shadow_height);
-          XFixesDestroyRegion (xdisplay, shadow_clip);
-        }
+  if (cw->shadow)
+    {
+      XRenderFreePicture (xdisplay, cw->shadow);
+      cw->shadow = None;
+    }
+
+  if (cw->shadow_pict)
+    {
+      XRenderFreePicture (xdisplay, cw->shadow_pict);
+      cw->shadow_pict = None;
     }
 }
 
-static void
-paint_windows (MetaScreen   *screen,
-               GList        *windows,
-               Picture       root_buffer,
-               XserverRegion region)
+/* Composites the black shadow colour through the shadow mask of a dock
+   once, docks hardly ever change so this is kept until the shadow is */
+static Picture
+get_dock_shadow (MetaCompWindow *cw)
 {
+  MetaScreen *screen = cw->screen;
   MetaDisplay *display = meta_screen_get_display (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
   MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  XRenderPictFormat *format;
+  XRenderColor clear = { 0, 0, 0, 0 };
+  Pixmap pixmap;
+
+  if (cw->shadow_pict != None || cw->shadow == None)
+    return cw->shadow_pict;
+
+  format = XRenderFindStandardFormat (xdisplay, PictStandardARGB32);
+  if (format == NULL)
+    return None;
+
+  pixmap = XCreatePixmap (xdisplay, meta_screen_get_xroot (screen),
+                          cw->shadow_width, cw->shadow_height, 32);
+  cw->shadow_pict = XRenderCreatePicture (xdisplay, pixmap, format, 0, NULL);
+  XFreePixmap (xdisplay, pixmap);
+
+  /* The mask is clipped to where the dock doesn't cover its shadow,
+     the rest of the picture has to be cleared first */
+  XRenderFillRectangle (xdisplay, PictOpSrc, cw->shadow_pict, &clear,
+                        0, 0, cw->shadow_width, cw->shadow_height);
+  XRenderComposite (xdisplay, PictOpOver, info->black_picture, cw->shadow,
+                    cw->shadow_pict, 0, 0, 0, 0, 0, 0,
+                    cw->shadow_width, cw->shadow_height);
+
+  return cw->shadow_pict;
+}
+
+static void
+paint_dock_shadows (MetaScreen     *screen,
+                    Picture         root_buffer,
+                    cairo_region_t *region)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
   Display *xdisplay = meta_display_get_xdisplay (display);
-  GList *index, *last;
-  int screen_width, screen_height;
-  MetaCompWindow *cw;
-  XserverRegion paint_region, desktop_region;
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  GSList *d;
 
   if (info == NULL)
     {
       return;
     }
 
-  meta_screen_get_size (screen, &screen_width, &screen_height);
-  
-  if (region == None)
-    {
-      XRectangle r;
-      r.x = 0;
-      r.y = 0;
-      r.width = screen_width;
-      r.height = screen_height;
-      paint_region = XFixesCreateRegion (xdisplay, &r, 1);
-    }
-  else
+  for (d = info->dock_windows; d; d = d->next)
     {
-      paint_region = XFixesCreateRegion (xdisplay, NULL, 0);
-      XFixesCopyRegion (xdisplay, paint_region, region);
-    }
+      MetaCompWindow *cw = d->data;
+      cairo_region_t *shadow_clip;
+      cairo_rectangle_int_t bounds;
+      Picture shadow;
 
-  desktop_region = None;
+      if (!cw->shadow || !cw->border_clip)
+        continue;
 
-  /*
-   * Painting from top to bottom, reducing the clipping area at
-   * each iteration. Only the opaque windows are painted 1st.
-   */
-  last = NULL;
-  for (index = windows; index; index = index->next)
-    {
-      /* Store the last window we dealt with */
-      last = index;
+      bounds.x = cw->attrs.x + cw->shadow_dx;
+      bounds.y = cw->attrs.y + cw->shadow_dy;
+      bounds.width = cw->shadow_width;
+      bounds.height = cw->shadow_height;
 
-      cw = (MetaCompWindow *) index->data;
-      if (!cw->damaged || cw->attrs.map_state == IsUnmapped)
-        {
-          /* Not damaged */
-          continue;
-        }
+      /* Most frames are nowhere near the docks */
+      if (cairo_region_contains_rectangle (region, &bounds) == CAIRO_REGION_OVERLAP_OUT)
+        continue;
 
-#if 0
-      if ((cw->attrs.x + cw->attrs.width < 1) ||
-          (cw->attrs.y + cw->attrs.height < 1) ||
-          (cw->attrs.x >= screen_width) || (cw->attrs.y >= screen_height))
-        {
-          /* Off screen */
-          continue;
-        }
-#endif
+      shadow = get_dock_shadow (cw);
+      if (shadow == None)
+        continue;
 
-      if (cw->picture == None)
-        cw->picture = get_window_picture (cw);
+      shadow_clip = cairo_region_copy (cw->border_clip);
+      cairo_region_intersect (shadow_clip, region);
 
-      /* If the clip region of the screen has been changed
-         then we need to recreate the extents of the window */
-      if (info->clip_changed)
+      if (!cairo_region_is_empty (shadow_clip))
         {
-          if (cw->border_size)
-            {
-              XFixesDestroyRegion (xdisplay, cw->border_size);
-              cw->border_size = None;
-            }
-
-          if (cw->window_size)
-            {
-              XFixesDestroyRegion (xdisplay, cw->window_size);
-              cw->window_size = None;
-            }
+          set_picture_clip_region (xdisplay, root_buffer, shadow_clip);
 
-#if 0
-          if (cw->extents)
-            {
-              XFixesDestroyRegion (xdisplay, cw->extents);
-              cw->extents = None;
-            }
-#endif
+          XRenderComposite (xdisplay, PictOpOver, shadow, None, root_buffer,
+                            0, 0, 0, 0, bounds.x, bounds.y,
+                            bounds.width, bounds.height);
         }
 
-      if (cw->border_size == None)
-        cw->border_size = border_size (cw);
+      cairo_region_destroy (shadow_clip);
+    }
+}
 
-      if (cw->window_size == None)
-        cw->window_size = window_size (cw);
+static void
+free_animation (MetaScreen        *screen,
+                MetaCompAnimation *anim)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
 
-      if (cw->extents == None)
-        cw->extents = win_extents (cw);
+  if (anim->picture != None)
+    XRenderFreePicture (meta_display_get_xdisplay (display), anim->picture);
 
-      if (cw->mode == WINDOW_SOLID)
-        {
-          if (cw->window && (cw->window->minimized || cw->window->hidden))
-            {
-              continue;
-            }
-          int x, y, wid, hei;
+  g_slice_free (MetaCompAnimation, anim);
+}
 
-          x = cw->attrs.x;
-          y = cw->attrs.y;
-          wid = cw->attrs.width + cw->attrs.border_width * 2;
-          hei = cw->attrs.height + cw->attrs.border_width * 2;
+/* Moves the animation to @progress, working out where the window is
+   drawn and how opaque. The window shrinks into its icon when it is
+   minimized, grows out of it when unminimized, and shrinks a little
+   about its centre while it fades out when closed */
+static void
+update_animation (MetaCompAnimation *anim,
+                  double             progress)
+{
+  MetaRectangle *from = &anim->window_rect;
+  MetaRectangle to;
+  double t;
 
-          XFixesSetPictureClipRegion (xdisplay, root_buffer,
-                                      0, 0, paint_region);
-          XRenderComposite (xdisplay, PictOpSrc, cw->picture,
-                            None, root_buffer, 0, 0, 0, 0,
-                            x, y, wid, hei);
+  anim->progress = progress;
 
-          if (cw->type == META_COMP_WINDOW_DESKTOP)
-            {
-              desktop_region = XFixesCreateRegion (xdisplay, 0, 0);
-              XFixesCopyRegion (xdisplay, desktop_region, paint_region);
-            }
+  /* Ease out, the window is quick to leave and slows into place */
+  t = 1 - (1 - progress) * (1 - progress) * (1 - progress);
 
-          XFixesSubtractRegion (xdisplay, paint_region,
-                                paint_region, cw->border_size);
-        }
+  switch (anim->effect)
+    {
+    case META_COMPOSITOR_EFFECT_MINIMIZE:
+      to = anim->icon_rect;
+      anim->opacity = 1 - 0.7 * t;
+      break;
 
-      if (!cw->border_clip)
-        {
-          cw->border_clip = XFixesCreateRegion (xdisplay, 0, 0);
-          XFixesCopyRegion (xdisplay, cw->border_clip, paint_region);
-        }
-    }
+    case META_COMPOSITOR_EFFECT_UNMINIMIZE:
+      from = &anim->icon_rect;
+      to = anim->window_rect;
+      anim->opacity = 0.3 + 0.7 * t;
+      break;
 
-  XFixesSetPictureClipRegion (xdisplay, root_buffer, 0, 0, paint_region);
-  paint_root (screen, root_buffer);
+    case META_COMPOSITOR_EFFECT_CLOSE:
+    default:
+      to.width = anim->window_rect.width * 0.85;
+      to.height = anim->window_rect.height * 0.85;
+      to.x = anim->window_rect.x + (anim->window_rect.width - to.width) / 2;
+      to.y = anim->window_rect.y + (anim->window_rect.height - to.height) / 2;
+      anim->opacity = 1 - t;
+      break;
+    }
 
-  paint_dock_shadows (screen, root_buffer, desktop_region == None ?
-                      paint_region : desktop_region);
-  if (desktop_region != None)
-    XFixesDestroyRegion (xdisplay, desktop_region);
+  anim->rect.x = from->x + (to.x - from->x) * t;
+  anim->rect.y = from->y + (to.y - from->y) * t;
+  anim->rect.width = MAX (from->width + (to.width - from->width) * t, 1);
+  anim->rect.height = MAX (from->height + (to.height - from->height) * t, 1);
+}
 
-  /*
-   * Painting from bottom to top, translucent windows and shadows are painted
-   */
-  for (index = last; index; index = index->prev)
-    {
-      cw = (MetaCompWindow *) index->data;
-      if (!cw->damaged || cw->attrs.map_state == IsUnmapped)
-        {
-          /* Not damaged */
-          continue;
-        }
+/* @rect is where the whole window picture is drawn while the window's
+   @outer rect is on screen. Moves and scales it so that the outer rect
+   lands on @target instead, margins and all */
+static void
+add_picture_margins (MetaRectangle       *rect,
+                     const MetaRectangle *target,
+                     const MetaRectangle *outer)
+{
+  double sx = outer->width > 0 ? (double) target->width / outer->width : 1;
+  double sy = outer->height > 0 ? (double) target->height / outer->height : 1;
 
-      if (cw->window && (cw->window->minimized || cw->window->hidden)) 
-        {
-          continue;
-        }
+  rect->x = target->x - (outer->x - rect->x) * sx;
+  rect->y = target->y - (outer->y - rect->y) * sy;
+  rect->width = MAX (rect->width * sx, 1);
+  rect->height = MAX (rect->height * sy, 1);
+}
 
-      if (cw->picture)
-        {
-          if (cw->shadow && cw->type != META_COMP_WINDOW_DOCK)
-            {
-              XserverRegion shadow_clip;
-
-              shadow_clip = XFixesCreateRegion (xdisplay, NULL, 0);
-              XFixesSubtractRegion (xdisplay, shadow_clip, cw->border_clip,
-                                    cw->window_size);
-              XFixesSetPictureClipRegion (xdisplay, root_buffer, 0, 0,
-                                          shadow_clip);
-
-              XRenderComposite (xdisplay, PictOpOver, info->black_picture,
-                                cw->shadow, root_buffer,
-                                0, 0, 0, 0,
-                                cw->attrs.x + cw->shadow_dx,
-                                cw->attrs.y + cw->shadow_dy,
-                                cw->shadow_width, cw->shadow_height);
-              if (shadow_clip)
-                XFixesDestroyRegion (xdisplay, shadow_clip);
+/* Draws the animated windows on top of everything else, scaling the
+   window pictures with a transform on the server */
+static void
+paint_animations (MetaScreen     *screen,
+                  Picture         root_buffer,
+                  cairo_region_t *region)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  GList *index;
+
+  if (info->animations == NULL)
+    return;
+
+  set_picture_clip_region (xdisplay, root_buffer, region);
+
+  /* Oldest last, so the window acted on most recently is on top */
+  for (index = g_list_last (info->animations); index; index = index->prev)
+    {
+      MetaCompAnimation *anim = (MetaCompAnimation *) index->data;
+      XTransform transform = { {
+        { XDoubleToFixed ((double) anim->width / anim->rect.width), 0, 0 },
+        { 0, XDoubleToFixed ((double) anim->height / anim->rect.height), 0 },
+        { 0, 0, XDoubleToFixed (1) }
+      } };
+      Picture alpha;
+
+      if (anim->opacity <= 0)
+        continue;
+
+      alpha = anim->opacity < 1 ? get_alpha_picture (screen, anim->opacity)
+                                : None;
+
+      XRenderSetPictureTransform (xdisplay, anim->picture, &transform);
+      XRenderComposite (xdisplay, PictOpOver, anim->picture, alpha,
+                        root_buffer, 0, 0, 0, 0,
+                        anim->rect.x, anim->rect.y,
+                        anim->rect.width, anim->rect.height);
+    }
+}
+
+/* Where the size label goes, centred in the outline. FALSE if there is
+   no label or it doesn't fit */
+static gboolean
+outline_label_rect (MetaCompScreen        *info,
+                    cairo_rectangle_int_t *rect)
+{
+  if (info->outline_label == None ||
+      info->outline_label_width > info->outline.width - OUTLINE_WIDTH * 2 ||
+      info->outline_label_height > info->outline.height - OUTLINE_WIDTH * 2)
+    return FALSE;
+
+  rect->width = info->outline_label_width;
+  rect->height = info->outline_label_height;
+  rect->x = info->outline.x + (info->outline.width - rect->width) / 2;
+  rect->y = info->outline.y + (info->outline.height - rect->height) / 2;
+
+  return TRUE;
+}
+
+/* The part of the screen the outline covers: its border and the label */
+static cairo_region_t *
+outline_region (MetaCompScreen *info)
+{
+  cairo_region_t *region;
+  cairo_rectangle_int_t inner, label;
+
+  region = cairo_region_create_rectangle (&info->outline);
+
+  inner.x = info->outline.x + OUTLINE_WIDTH;
+  inner.y = info->outline.y + OUTLINE_WIDTH;
+  inner.width = info->outline.width - OUTLINE_WIDTH * 2;
+  inner.height = info->outline.height - OUTLINE_WIDTH * 2;
+
+  if (inner.width > 0 && inner.height > 0)
+    {
+      cairo_region_t *inside = cairo_region_create_rectangle (&inner);
+
+      cairo_region_subtract (region, inside);
+      cairo_region_destroy (inside);
+    }
+
+  if (outline_label_rect (info, &label))
+    cairo_region_union_rectangle (region, &label);
+
+  return region;
+}
+
+static void
+free_outline_label (MetaScreen *screen)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+
+  if (info->outline_label != None)
+    XRenderFreePicture (meta_display_get_xdisplay (display),
+                        info->outline_label);
+
+  info->outline_label = None;
+  info->outline_label_width = 0;
+  info->outline_label_height = 0;
+}
+
+/* Draws "cols x rows" with cairo into a picture of its own, which is
+   only redone when the numbers change */
+static void
+update_outline_label (MetaScreen *screen,
+                      int         cols,
+                      int         rows)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  XRenderPictFormat *format;
+  cairo_text_extents_t extents;
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  Pixmap pixmap;
+  char *text;
+  int width, height;
+
+  if (info->outline_label != None &&
+      info->outline_label_cols == cols && info->outline_label_rows == rows)
+    return;
+
+  free_outline_label (screen);
+
+  format = XRenderFindStandardFormat (xdisplay, PictStandardARGB32);
+  if (format == NULL)
+    return;
+
+  text = g_strdup_printf ("%d x %d", cols, rows);
+
+  /* Measure the text on a scratch surface first */
+  surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, 1, 1);
+  cr = cairo_create (surface);
+  cairo_set_font_size (cr, OUTLINE_LABEL_FONT_SIZE);
+  cairo_text_extents (cr, text, &extents);
+  cairo_destroy (cr);
+  cairo_surface_destroy (surface);
+
+  width = ceil (extents.width) + OUTLINE_LABEL_PADDING * 2;
+  height = ceil (extents.height) + OUTLINE_LABEL_PADDING * 2;
+
+  pixmap = XCreatePixmap (xdisplay, meta_screen_get_xroot (screen),
+                          width, height, 32);
+  surface = cairo_xlib_surface_create_with_xrender_format
+    (xdisplay, pixmap,
+     ScreenOfDisplay (xdisplay, meta_screen_get_screen_number (screen)),
+     format, width, height);
+
+  cr = cairo_create (surface);
+  cairo_set_source_rgba (cr, 0, 0, 0, 0.7);
+  cairo_paint (cr);
+  cairo_set_source_rgb (cr, 1, 1, 1);
+  cairo_set_font_size (cr, OUTLINE_LABEL_FONT_SIZE);
+  cairo_move_to (cr, OUTLINE_LABEL_PADDING - extents.x_bearing,
+                 OUTLINE_LABEL_PADDING - extents.y_bearing);
+  cairo_show_text (cr, text);
+  cairo_destroy (cr);
+  cairo_surface_destroy (surface);
+  g_free (text);
+
+  info->outline_label = XRenderCreatePicture (xdisplay, pixmap, format,
+                                              0, NULL);
+  XFreePixmap (xdisplay, pixmap);
+
+  info->outline_label_width = width;
+  info->outline_label_height = height;
+  info->outline_label_cols = cols;
+  info->outline_label_rows = rows;
+}
+
+static void
+paint_outline (MetaScreen     *screen,
+               Picture         root_buffer,
+               cairo_region_t *region)
+{
+  /* #3a8ee6 at 90%, premultiplied */
+  static const XRenderColor color = { 0x3464, 0x8010, 0xcfcf, 0xe666 };
+  MetaDisplay *display = meta_screen_get_display (screen);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  cairo_rectangle_int_t label;
+  XRectangle *rects;
+  cairo_region_t *border;
+  int n_rects;
+
+  if (!info->have_outline)
+    return;
+
+  set_picture_clip_region (xdisplay, root_buffer, region);
+
+  border = outline_region (info);
+  if (outline_label_rect (info, &label))
+    cairo_region_subtract_rectangle (border, &label);
+
+  rects = cairo_region_to_xrectangles (border, &n_rects);
+  XRenderFillRectangles (xdisplay, PictOpOver, root_buffer, &color,
+                         rects, n_rects);
+  g_free (rects);
+  cairo_region_destroy (border);
+
+  if (outline_label_rect (info, &label))
+    XRenderComposite (xdisplay, PictOpOver, info->outline_label, None,
+                      root_buffer, 0, 0, 0, 0,
+                      label.x, label.y, label.width, label.height);
+}
+
+static void
+paint_windows (MetaScreen     *screen,
+               GList          *windows,
+               Picture         root_buffer,
+               cairo_region_t *region)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  GList *index, *last;
+  int screen_width, screen_height;
+  MetaCompWindow *cw;
+  cairo_region_t *paint_region, *desktop_region;
+
+  if (info == NULL)
+    {
+      return;
+    }
+
+  meta_screen_get_size (screen, &screen_width, &screen_height);
+
+  if (region == NULL)
+    {
+      cairo_rectangle_int_t r;
+      r.x = 0;
+      r.y = 0;
+      r.width = screen_width;
+      r.height = screen_height;
+      paint_region = cairo_region_create_rectangle (&r);
+    }
+  else
+    {
+      paint_region = cairo_region_copy (region);
+    }
+
+  desktop_region = NULL;
+
+  /*
+   * Painting from top to bottom, reducing the clipping area at
+   * each iteration. Only the opaque windows are painted 1st.
+   *
+   * All of the clip arithmetic happens on client side regions, the
+   * server only ever sees the final clip of each composite.
+   */
+  last = NULL;
+  for (index = windows; index; index = index->next)
+    {
+      /* Store the last window we dealt with */
+      last = index;
+
+      cw = (MetaCompWindow *) index->data;
+      if (!cw->damaged || cw->attrs.map_state == IsUnmapped)
+        {
+          /* Not damaged */
+          continue;
+        }
+
+      /* The server draws this one itself */
+      if (cw->unredirected)
+        continue;
+
+      if (cw->animating)
+        continue;
+
+#if 0
+      if ((cw->attrs.x + cw->attrs.width < 1) ||
+          (cw->attrs.y + cw->attrs.height < 1) ||
+          (cw->attrs.x >= screen_width) || (cw->attrs.y >= screen_height))
+        {
+          /* Off screen */
+          continue;
+        }
+#endif
+
+      if (cw->pixmap_state == PIXMAP_STALE)
+        free_window_pixmap (cw);
+
+      if (cw->picture == None)
+        cw->picture = get_window_picture (cw);
+
+      if (cw->border_size == NULL)
+        cw->border_size = border_size (cw);
+
+      if (cw->window_size == NULL)
+        cw->window_size = window_size (cw);
+
+      if (cw->extents == NULL)
+        cw->extents = win_extents (cw);
+
+      if (cw->mode == WINDOW_SOLID)
+        {
+          if (cw->window && (cw->window->minimized || cw->window->hidden))
+            {
+              continue;
+            }
+          int x, y, wid, hei;
+          cairo_rectangle_int_t bounds;
+
+          x = cw->attrs.x;
+          y = cw->attrs.y;
+          wid = cw->attrs.width + cw->attrs.border_width * 2;
+          hei = cw->attrs.height + cw->attrs.border_width * 2;
+
+          bounds.x = x;
+          bounds.y = y;
+          bounds.width = wid;
+          bounds.height = hei;
+
+          /* Windows that are entirely clipped away don't need any request */
+          if (cairo_region_contains_rectangle (paint_region, &bounds) != CAIRO_REGION_OVERLAP_OUT)
+            {
+              set_picture_clip_region (xdisplay, root_buffer, paint_region);
+              XRenderComposite (xdisplay, PictOpSrc, cw->picture,
+                                None, root_buffer, 0, 0, 0, 0,
+                                x, y, wid, hei);
+              info->windows_painted++;
+            }
+
+          if (cw->type == META_COMP_WINDOW_DESKTOP)
+            {
+              if (desktop_region != NULL)
+                cairo_region_destroy (desktop_region);
+              desktop_region = cairo_region_copy (paint_region);
+            }
+
+          cairo_region_subtract (paint_region, cw->border_size);
+        }
+
+      if (!cw->border_clip)
+        cw->border_clip = cairo_region_copy (paint_region);
+    }
+
+  if (!cairo_region_is_empty (paint_region))
+    {
+      set_picture_clip_region (xdisplay, root_buffer, paint_region);
+      paint_root (screen, root_buffer);
+    }
+
+  paint_dock_shadows (screen, root_buffer, desktop_region == NULL ?
+                      paint_region : desktop_region);
+  if (desktop_region != NULL)
+    cairo_region_destroy (desktop_region);
+
+  /*
+   * Painting from bottom to top, translucent windows and shadows are painted
+   */
+  for (index = last; index; index = index->prev)
+    {
+      cw = (MetaCompWindow *) index->data;
+      if (!cw->damaged || cw->attrs.map_state == IsUnmapped ||
+          cw->unredirected || cw->animating)
+        {
+          /* Not damaged */
+          continue;
+        }
+
+      if (cw->window && (cw->window->minimized || cw->window->hidden)) 
+        {
+          if (cw->border_clip)
+            {
+              cairo_region_destroy (cw->border_clip);
+              cw->border_clip = NULL;
+            }
+          continue;
+        }
+
+      if (cw->picture && cw->border_clip &&
+          !cairo_region_is_empty (cw->border_clip))
+        {
+          if (cw->shadow && cw->type != META_COMP_WINDOW_DOCK)
+            {
+              cairo_region_t *shadow_clip;
+
+              shadow_clip = cairo_region_copy (cw->border_clip);
+              cairo_region_subtract (shadow_clip, cw->window_size);
+
+              if (!cairo_region_is_empty (shadow_clip))
+                {
+                  set_picture_clip_region (xdisplay, root_buffer, shadow_clip);
+
+                  XRenderComposite (xdisplay, PictOpOver, info->black_picture,
+                                    cw->shadow, root_buffer,
+                                    0, 0, 0, 0,
+                                    cw->attrs.x + cw->shadow_dx,
+                                    cw->attrs.y + cw->shadow_dy,
+                                    cw->shadow_width, cw->shadow_height);
+                }
+              cairo_region_destroy (shadow_clip);
             }
 
           if ((cw->opacity != (guint) OPAQUE) && !(cw->alpha_pict))
             {
-              cw->alpha_pict = solid_picture (display, screen, FALSE,
-                                              (double) cw->opacity / OPAQUE,
-                                              0, 0, 0);
+              cw->alpha_pict = get_alpha_picture (screen,
+                                                  (double) cw->opacity / OPAQUE);
+            }
+
+          cairo_region_intersect (cw->border_clip, cw->border_size);
+          if (cw->mode == WINDOW_ARGB && !cairo_region_is_empty (cw->border_clip))
+            {
+              int x, y, wid, hei;
+
+              x = cw->attrs.x;
+              y = cw->attrs.y;
+              wid = cw->attrs.width + cw->attrs.border_width * 2;
+              hei = cw->attrs.height + cw->attrs.border_width * 2;
+
+              set_picture_clip_region (xdisplay, root_buffer, cw->border_clip);
+              XRenderComposite (xdisplay, PictOpOver, cw->picture,
+                                cw->alpha_pict, root_buffer, 0, 0, 0, 0,
+                                x, y, wid, hei);
+              info->windows_painted++;
             }
+        }
+
+      if (cw->border_clip)
+        {
+          cairo_region_destroy (cw->border_clip);
+          cw->border_clip = NULL;
+        }
+    }
+
+  paint_animations (screen, root_buffer, region);
+  paint_outline (screen, root_buffer, region);
+
+  XFlush(xdisplay);
+  cairo_region_destroy (paint_region);
+}
+
+static void
+free_heatmap (MetaCompScreen *info)
+{
+  g_free (info->heat);
+  info->heat = NULL;
+  info->heat_cols = 0;
+  info->heat_rows = 0;
+  info->heat_warm = FALSE;
+}
+
+/* Heats up the tiles under this frame's damage, then adds every tile
+   that is still warm to the damage so its overlay gets to fade out */
+static void
+heat_damage (MetaScreen *screen)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  cairo_region_t *warm;
+  int width, height, cols, rows;
+  int i, x, y;
+
+  meta_screen_get_size (screen, &width, &height);
+  cols = (width + HEATMAP_TILE - 1) / HEATMAP_TILE;
+  rows = (height + HEATMAP_TILE - 1) / HEATMAP_TILE;
+
+  if (info->heat == NULL || cols != info->heat_cols || rows != info->heat_rows)
+    {
+      free_heatmap (info);
+      info->heat = g_new0 (guchar, cols * rows);
+      info->heat_cols = cols;
+      info->heat_rows = rows;
+    }
+
+  if (info->all_damage != NULL)
+    {
+      for (i = 0; i < cairo_region_num_rectangles (info->all_damage); i++)
+        {
+          cairo_rectangle_int_t rect;
+          int x1, y1, x2, y2;
+
+          cairo_region_get_rectangle (info->all_damage, i, &rect);
+          if (rect.width <= 0 || rect.height <= 0)
+            continue;
+
+          x1 = MAX (rect.x, 0) / HEATMAP_TILE;
+          y1 = MAX (rect.y, 0) / HEATMAP_TILE;
+          x2 = MIN ((rect.x + rect.width - 1) / HEATMAP_TILE, cols - 1);
+          y2 = MIN ((rect.y + rect.height - 1) / HEATMAP_TILE, rows - 1);
+
+          for (y = y1; y <= y2; y++)
+            for (x = x1; x <= x2; x++)
+              {
+                guchar *heat = &info->heat[y * cols + x];
+
+                *heat = MIN (*heat + HEATMAP_HEAT, 255);
+              }
+        }
+    }
+
+  warm = cairo_region_create ();
+  for (y = 0; y < rows; y++)
+    for (x = 0; x < cols; x++)
+      {
+        if (info->heat[y * cols + x] != 0)
+          {
+            cairo_rectangle_int_t tile = {
+              x * HEATMAP_TILE, y * HEATMAP_TILE, HEATMAP_TILE, HEATMAP_TILE
+            };
+
+            cairo_region_union_rectangle (warm, &tile);
+          }
+      }
+
+  if (cairo_region_is_empty (warm))
+    cairo_region_destroy (warm);
+  else if (info->all_damage == NULL)
+    info->all_damage = warm;
+  else
+    {
+      cairo_region_union (info->all_damage, warm);
+      cairo_region_destroy (warm);
+    }
+}
+
+/* Draws the warm tiles over the frame, from faint blue to red, with one
+   request per colour, then cools them all down a notch */
+static void
+paint_heatmap (MetaScreen *screen,
+               Picture     dest)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  Display *xdisplay = meta_display_get_xdisplay (meta_screen_get_display (screen));
+  XRectangle *tiles;
+  int n_tiles = info->heat_cols * info->heat_rows;
+  int level, i;
+
+  if (info->heat == NULL)
+    return;
+
+  tiles = g_new (XRectangle, n_tiles);
+
+  for (level = 0; level < HEATMAP_LEVELS; level++)
+    {
+      double t = (double) (level + 1) / HEATMAP_LEVELS;
+      double alpha = 0.15 + 0.45 * t;
+      XRenderColor c;
+      int n = 0;
+
+      for (i = 0; i < n_tiles; i++)
+        {
+          int heat = info->heat[i];
+
+          if (heat == 0 || heat * HEATMAP_LEVELS / 256 != level)
+            continue;
+
+          tiles[n].x = (i % info->heat_cols) * HEATMAP_TILE;
+          tiles[n].y = (i / info->heat_cols) * HEATMAP_TILE;
+          tiles[n].width = HEATMAP_TILE;
+          tiles[n].height = HEATMAP_TILE;
+          n++;
+        }
+
+      if (n == 0)
+        continue;
+
+      /* Premultiplied */
+      c.alpha = alpha * 0xffff;
+      c.red = t * alpha * 0xffff;
+      c.green = 0;
+      c.blue = (1 - t) * alpha * 0xffff;
+
+      XRenderFillRectangles (xdisplay, PictOpOver, dest, &c, tiles, n);
+    }
+
+  g_free (tiles);
+
+  info->heat_warm = FALSE;
+  for (i = 0; i < n_tiles; i++)
+    {
+      int heat = info->heat[i];
+
+      info->heat[i] = MAX (heat - heat / 8 - 1, 0);
+      if (info->heat[i] != 0)
+        info->heat_warm = TRUE;
+    }
+}
+
+#ifdef HAVE_PRESENT
+static void
+free_back_buffers (MetaScreen *screen)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  int i;
+
+  for (i = 0; i < BACK_BUFFER_COUNT; i++)
+    {
+      MetaBackBuffer *buffer = &info->back_buffers[i];
+
+      /* The server keeps a pixmap that is still on screen alive itself */
+      if (buffer->picture != None)
+        XRenderFreePicture (xdisplay, buffer->picture);
+      if (buffer->pixmap != None)
+        XFreePixmap (xdisplay, buffer->pixmap);
+
+      buffer->picture = None;
+      buffer->pixmap = None;
+      buffer->frame = 0;
+      buffer->busy = FALSE;
+
+      if (info->damage_history[i] != NULL)
+        {
+          cairo_region_destroy (info->damage_history[i]);
+          info->damage_history[i] = NULL;
+        }
+    }
+}
+
+/* The idle buffer painted most recently, so the one needing the least
+   repainting, or NULL if the server is still using all of them */
+static MetaBackBuffer *
+find_back_buffer (MetaCompScreen *info)
+{
+  MetaBackBuffer *best = NULL;
+  int i;
+
+  for (i = 0; i < BACK_BUFFER_COUNT; i++)
+    {
+      MetaBackBuffer *buffer = &info->back_buffers[i];
+
+      if (!buffer->busy && (best == NULL || buffer->frame > best->frame))
+        best = buffer;
+    }
+
+  return best;
+}
+
+static gboolean
+create_back_buffer (MetaScreen     *screen,
+                    MetaBackBuffer *buffer)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  XRenderPictFormat *format;
+  int screen_width, screen_height, screen_number;
+
+  meta_screen_get_size (screen, &screen_width, &screen_height);
+  screen_number = meta_screen_get_screen_number (screen);
+
+  format = XRenderFindVisualFormat (xdisplay,
+                                    DefaultVisual (xdisplay, screen_number));
+  g_return_val_if_fail (format != NULL, FALSE);
+
+  buffer->pixmap = XCreatePixmap (xdisplay, info->output,
+                                  screen_width, screen_height,
+                                  DefaultDepth (xdisplay, screen_number));
+  g_return_val_if_fail (buffer->pixmap != None, FALSE);
+
+  buffer->picture = XRenderCreatePicture (xdisplay, buffer->pixmap,
+                                          format, 0, NULL);
+  buffer->frame = 0;
+
+  return TRUE;
+}
+
+/* What has to be painted into @buffer for it to show frame @frame, whose
+   own damage is @region: everything that changed since the buffer was
+   last painted, or the whole screen if that is too long ago to know */
+static cairo_region_t *
+back_buffer_damage (MetaScreen     *screen,
+                    MetaBackBuffer *buffer,
+                    guint64         frame,
+                    cairo_region_t *region)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  cairo_region_t *damage;
+  guint64 i;
+
+  if (buffer->frame == 0 || frame - buffer->frame > BACK_BUFFER_COUNT)
+    {
+      cairo_rectangle_int_t r;
+
+      r.x = 0;
+      r.y = 0;
+      meta_screen_get_size (screen, &r.width, &r.height);
+
+      return cairo_region_create_rectangle (&r);
+    }
+
+  damage = cairo_region_copy (region);
+  for (i = buffer->frame + 1; i < frame; i++)
+    cairo_region_union (damage, info->damage_history[i % BACK_BUFFER_COUNT]);
+
+  return damage;
+}
+
+/* Paints the frame into the back buffer and asks the server to show it
+   on the next vblank. Only the damage of the frame is sent as the update
+   region, which is all the server has to copy when it can't just flip */
+static void
+present_all (MetaScreen     *screen,
+             cairo_region_t *region)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  MetaDisplay *display = meta_screen_get_display (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  MetaBackBuffer *buffer;
+  cairo_region_t *paint_region;
+  XserverRegion update;
+  XRectangle *rects;
+  int n_rects, slot;
+  guint64 frame;
+
+  buffer = find_back_buffer (info);
+  g_return_if_fail (buffer != NULL);
+
+  if (buffer->pixmap == None && !create_back_buffer (screen, buffer))
+    return;
+
+  frame = ++info->present_frame;
+  paint_region = back_buffer_damage (screen, buffer, frame, region);
+
+  paint_windows (screen, info->windows, buffer->picture, paint_region);
+
+  set_picture_clip_region (xdisplay, buffer->picture, paint_region);
+
+  if (DISPLAY_COMPOSITOR (display)->show_redraw)
+    {
+      dump_region ("present_all", display, paint_region);
+      paint_heatmap (screen, buffer->picture);
+    }
+
+  cairo_region_destroy (paint_region);
+
+  slot = frame % BACK_BUFFER_COUNT;
+  if (info->damage_history[slot] != NULL)
+    cairo_region_destroy (info->damage_history[slot]);
+  info->damage_history[slot] = cairo_region_copy (region);
+
+  rects = cairo_region_to_xrectangles (region, &n_rects);
+  update = XFixesCreateRegion (xdisplay, rects, n_rects);
+  g_free (rects);
+
+  XPresentPixmap (xdisplay, info->output, buffer->pixmap, (guint32) frame,
+                  None, update, 0, 0, None, None, None, PresentOptionNone,
+                  0, 0, 0, NULL, 0);
+  XFixesDestroyRegion (xdisplay, update);
+
+  buffer->frame = frame;
+  buffer->busy = TRUE;
+}
+#endif
+
+static void
+paint_all (MetaScreen     *screen,
+           cairo_region_t *region)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  MetaDisplay *display = meta_screen_get_display (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  int screen_width, screen_height;
+
+#ifdef HAVE_PRESENT
+  if (info->use_back_buffers)
+    {
+      present_all (screen, region);
+      return;
+    }
+#endif
+
+  /* Set clipping to the given region */
+  set_picture_clip_region (xdisplay, info->root_picture, region);
+
+  meta_screen_get_size (screen, &screen_width, &screen_height);
+
+  if (info->root_buffer == None)
+    info->root_buffer = create_root_buffer (screen);
+
+  paint_windows (screen, info->windows, info->root_buffer, region);
+
+  set_picture_clip_region (xdisplay, info->root_buffer, region);
+
+  if (DISPLAY_COMPOSITOR (display)->show_redraw)
+    {
+      dump_region ("paint_all", display, region);
+      paint_heatmap (screen, info->root_buffer);
+    }
+
+  XRenderComposite (xdisplay, PictOpSrc, info->root_buffer, None,
+                    info->root_picture, 0, 0, 0, 0, 0, 0,
+                    screen_width, screen_height);
+}
+
+static void
+update_unredirection (MetaScreen *screen);
+
+static void
+flush_pending_repairs (MetaScreen *screen);
+
+#ifdef USE_IDLE_REPAINT
+static void
+take_output_damage (MetaScreen *screen);
+#endif
+
+static void
+advance_animations (MetaScreen *screen);
+
+static void
+repair_screen (MetaScreen *screen)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  MetaDisplay *display = meta_screen_get_display (screen);
+
+  if (info == NULL)
+    return;
+
+  flush_pending_repairs (screen);
+
+  meta_error_trap_push (display);
+  update_unredirection (screen);
+  meta_error_trap_pop (display, FALSE);
+
+  advance_animations (screen);
+
+#ifdef USE_IDLE_REPAINT
+  take_output_damage (screen);
+#endif
+
+  if (info->all_damage != NULL && info->unredirected != NULL)
+    {
+      MetaCompWindow *cw = info->unredirected;
+
+      /* Nothing painted under the unredirected window would be seen */
+      if (cw->border_size == NULL)
+        cw->border_size = border_size (cw);
+
+      cairo_region_subtract (info->all_damage, cw->border_size);
+      if (cairo_region_is_empty (info->all_damage))
+        {
+          cairo_region_destroy (info->all_damage);
+          info->all_damage = NULL;
+        }
+    }
+
+#ifdef HAVE_PRESENT
+  /* The server is still using every back buffer, the damage waits for
+     the next frame */
+  if (info->use_back_buffers && find_back_buffer (info) == NULL)
+    return;
+#endif
+
+  if (DISPLAY_COMPOSITOR (display)->show_redraw)
+    heat_damage (screen);
+
+  if (info->all_damage != NULL)
+    {
+      MetaCompositorXRender *compositor = DISPLAY_COMPOSITOR (display);
+      Display *xdisplay = meta_display_get_xdisplay (display);
+      MetaFrameStats *stats;
+      unsigned long first_request;
+      gint64 start;
+
+      stats = &compositor->frame_stats[compositor->n_frames % FRAME_STATS_HISTORY];
+      compositor->n_frames++;
+
+      stats->damaged_area = region_area (info->all_damage);
+      stats->culled_area = info->culled_area - info->frame_culled_area;
+      info->frame_culled_area = info->culled_area;
+      info->windows_painted = 0;
+
+      start = g_get_monotonic_time ();
+      first_request = NextRequest (xdisplay);
+
+      meta_error_trap_push (display);
+      paint_all (screen, info->all_damage);
+      cairo_region_destroy (info->all_damage);
+      info->all_damage = NULL;
+      info->clip_changed = FALSE;
+      meta_error_trap_pop (display, FALSE);
+
+      stats->requests = NextRequest (xdisplay) - first_request;
+      stats->windows_painted = info->windows_painted;
+      stats->paint_time = g_get_monotonic_time () - start;
+#ifdef USE_IDLE_REPAINT
+      stats->late = (start + stats->paint_time > compositor->target_vblank);
+#else
+      stats->late = FALSE;
+#endif
+      if (stats->late)
+        compositor->n_late_frames++;
+
+      if (DISPLAY_COMPOSITOR (display)->debug)
+        fprintf (stderr, "occlusion culled %" G_GUINT64_FORMAT " of %"
+                 G_GUINT64_FORMAT " damaged pixels\n",
+                 info->culled_area, info->damage_area);
+    }
+}
+
+static void
+repair_display (MetaDisplay *display)
+{
+  GSList *screens = meta_display_get_screens (display);
+  MetaCompositorXRender *compositor = DISPLAY_COMPOSITOR (display);
+
+#ifdef USE_IDLE_REPAINT
+  if (compositor->repaint_id > 0)
+    {
+      g_source_remove (compositor->repaint_id);
+      compositor->repaint_id = 0;
+    }
+#endif
+
+  for (; screens; screens = screens->next)
+    repair_screen ((MetaScreen *) screens->data);
+}
+
+#ifdef USE_IDLE_REPAINT
+#ifdef HAVE_RANDR
+/* Returns the fastest refresh rate of the active CRTCs showing part of
+   @rect, or 0 if the server doesn't report one */
+static double
+get_randr_refresh_rate (MetaDisplay   *display,
+                        Window         xroot,
+                        MetaRectangle *rect)
+{
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  XRRScreenResources *resources;
+  double rate = 0;
+  int i, j;
+
+  meta_error_trap_push (display);
+  resources = XRRGetScreenResourcesCurrent (xdisplay, xroot);
+  if (resources == NULL)
+    {
+      meta_error_trap_pop (display, FALSE);
+      return 0;
+    }
+
+  for (i = 0; i < resources->ncrtc; i++)
+    {
+      XRRCrtcInfo *crtc;
+
+      crtc = XRRGetCrtcInfo (xdisplay, resources, resources->crtcs[i]);
+      if (crtc == NULL)
+        continue;
+
+      if (crtc->x >= rect->x + rect->width ||
+          crtc->y >= rect->y + rect->height ||
+          crtc->x + (int) crtc->width <= rect->x ||
+          crtc->y + (int) crtc->height <= rect->y)
+        {
+          XRRFreeCrtcInfo (crtc);
+          continue;
+        }
+
+      for (j = 0; crtc->mode != None && j < resources->nmode; j++)
+        {
+          XRRModeInfo *mode = &resources->modes[j];
+          double mode_rate;
+
+          if (mode->id != crtc->mode || mode->hTotal == 0 || mode->vTotal == 0)
+            continue;
+
+          mode_rate = (double) mode->dotClock /
+                      ((double) mode->hTotal * (double) mode->vTotal);
+          if (mode->modeFlags & RR_DoubleScan)
+            mode_rate /= 2;
+          if (mode->modeFlags & RR_Interlace)
+            mode_rate *= 2;
+
+          rate = MAX (rate, mode_rate);
+          break;
+        }
+
+      XRRFreeCrtcInfo (crtc);
+    }
+
+  XRRFreeScreenResources (resources);
+  meta_error_trap_pop (display, FALSE);
+
+  return rate;
+}
+#endif
+
+static gint64
+get_frame_interval (MetaScreen    *screen,
+                    MetaRectangle *rect)
+{
+  const char *mode = g_getenv ("META_IDLE_PAINT_MODE");
+  double rate = 0;
+
+  if (mode != NULL && g_str_equal (mode, "fixed"))
+    {
+      /* A fixed virtual refresh, whatever the outputs are running at */
+      const char *fps_str = g_getenv ("META_IDLE_PAINT_FPS");
+
+      rate = fps_str == NULL ? 30 : atoi (fps_str);
+    }
+#ifdef HAVE_RANDR
+  else
+    rate = get_randr_refresh_rate (meta_screen_get_display (screen),
+                                   meta_screen_get_xroot (screen), rect);
+#endif
+
+  if (rate <= 0)
+    rate = FALLBACK_REFRESH_RATE;
+
+  meta_verbose ("Compositor frame clock for output %dx%d+%d+%d running "
+                "at %.2f Hz\n", rect->width, rect->height, rect->x, rect->y,
+                rate);
+
+  return (gint64) (G_USEC_PER_SEC / rate);
+}
+
+/* Returns the first vblank of @output at or after time, extrapolated
+   from the last one we know of */
+static gint64
+next_vblank (MetaCompOutput *output,
+             gint64          time)
+{
+  gint64 interval = output->frame_interval;
+
+  /* Without any feedback from the server the first frame sets the
+     phase of the virtual refresh */
+  if (output->last_vblank == 0)
+    output->last_vblank = time;
+
+  if (time <= output->last_vblank)
+    return output->last_vblank;
+
+  return output->last_vblank +
+         ((time - output->last_vblank + interval - 1) / interval) * interval;
+}
+
+static void
+free_outputs (MetaCompScreen *info)
+{
+  int i;
+
+  for (i = 0; i < info->n_outputs; i++)
+    if (info->outputs[i].damage != NULL)
+      cairo_region_destroy (info->outputs[i].damage);
+
+  g_free (info->outputs);
+  info->outputs = NULL;
+  info->n_outputs = 0;
+}
+
+/* Follows the Xinerama screens of @screen. Outputs that come and go get
+   fully repainted, nothing is known about what they show */
+static void
+update_outputs (MetaScreen *screen)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  int i;
+
+  if (info->n_outputs == screen->n_xinerama_infos)
+    {
+      for (i = 0; i < info->n_outputs; i++)
+        if (!meta_rectangle_equal (&info->outputs[i].rect,
+                                   &screen->xinerama_infos[i].rect))
+          break;
+
+      if (i == info->n_outputs)
+        return;
+    }
+
+  free_outputs (info);
+
+  info->n_outputs = screen->n_xinerama_infos;
+  info->outputs = g_new0 (MetaCompOutput, info->n_outputs);
+
+  for (i = 0; i < info->n_outputs; i++)
+    {
+      MetaCompOutput *output = &info->outputs[i];
+      cairo_rectangle_int_t r;
+
+      output->rect = screen->xinerama_infos[i].rect;
+
+      r.x = output->rect.x;
+      r.y = output->rect.y;
+      r.width = output->rect.width;
+      r.height = output->rect.height;
+      output->damage = cairo_region_create_rectangle (&r);
+    }
+}
+
+/* Picks the vblank the next frame of @output is aimed at */
+static void
+schedule_output (MetaScreen     *screen,
+                 MetaCompOutput *output,
+                 gint64          now)
+{
+  MetaCompositorXRender *compositor =
+    DISPLAY_COMPOSITOR (meta_screen_get_display (screen));
+  gint64 target;
+
+  if (output->frame_interval == 0)
+    {
+      output->frame_interval = get_frame_interval (screen, &output->rect);
+
+      if (compositor->frame_interval == 0 ||
+          output->frame_interval < compositor->frame_interval)
+        compositor->frame_interval = output->frame_interval;
+    }
+
+  target = next_vblank (output, now + compositor->frame_budget);
+
+  /* Never paint twice for the same refresh */
+  while (target <= output->last_target_vblank)
+    target += output->frame_interval;
+
+  output->target_vblank = target;
+}
+
+static gboolean
+output_needs_frame (MetaCompScreen *info,
+                    MetaCompOutput *output)
+{
+  return output->damage != NULL || info->heat_warm;
+}
+
+/* Moves the damage of the outputs whose deadline has come into
+   info->all_damage. The others keep theirs until their own frame */
+static void
+take_output_damage (MetaScreen *screen)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  MetaCompositorXRender *compositor =
+    DISPLAY_COMPOSITOR (meta_screen_get_display (screen));
+  gint64 now = g_get_monotonic_time ();
+  gboolean busy = FALSE;
+  int i;
+
+#ifdef HAVE_PRESENT
+  busy = (info->use_back_buffers && find_back_buffer (info) == NULL);
+#endif
+
+  update_outputs (screen);
+
+  compositor->target_vblank = G_MAXINT64;
+
+  for (i = 0; i < info->n_outputs; i++)
+    {
+      MetaCompOutput *output = &info->outputs[i];
+
+      if (!output_needs_frame (info, output))
+        continue;
+
+      if (output->target_vblank == 0)
+        schedule_output (screen, output, now);
+
+      /* Timeouts only have millisecond precision */
+      if (output->target_vblank - compositor->frame_budget > now + 1000)
+        continue;
+
+      /* With no back buffer to paint into the output misses this
+         refresh and keeps its damage for the next one */
+      if (!busy && output->damage != NULL)
+        {
+          if (info->all_damage == NULL)
+            info->all_damage = output->damage;
+          else
+            {
+              cairo_region_union (info->all_damage, output->damage);
+              cairo_region_destroy (output->damage);
+            }
+
+          output->damage = NULL;
+        }
+
+      compositor->target_vblank = MIN (compositor->target_vblank,
+                                       output->target_vblank);
+      output->last_target_vblank = output->target_vblank;
+      output->target_vblank = 0;
+    }
+}
+
+static void
+finish_frame (MetaCompositorXRender *compositor,
+              gint64                 paint_time)
+{
+  /* Keep the budget comfortably above the recent paint times so the
+     frame is on screen before the vblank it was aimed at */
+  compositor->paint_time = (compositor->paint_time * 7 + paint_time) / 8;
+  compositor->frame_budget = CLAMP (compositor->paint_time * 3 / 2,
+                                    MIN_FRAME_BUDGET,
+                                    MAX (compositor->frame_interval / 2,
+                                         MIN_FRAME_BUDGET));
+
+#ifdef HAVE_PRESENT
+  if (compositor->have_present)
+    {
+      GSList *screens = meta_display_get_screens (compositor->display);
+      MetaCompScreen *info;
+
+      /* Ask to be told when the next vblank happens so the frame clock
+         stays in phase with the display */
+      info = screens ? meta_screen_get_compositor_data (screens->data) : NULL;
+      if (info != NULL && info->present_event != None)
+        XPresentNotifyMSC (meta_display_get_xdisplay (compositor->display),
+                           info->output, 0, 0, 1, 0);
+    }
+#endif
+}
+
+static void
+add_repair (MetaDisplay *display);
+
+static gboolean
+compositor_idle_cb (gpointer data)
+{
+  MetaCompositorXRender *compositor = (MetaCompositorXRender *) data;
+  GSList *screens;
+  gint64 start;
+
+  compositor->repaint_id = 0;
+
+  start = g_get_monotonic_time ();
+  compositor->repairing = TRUE;
+  repair_display (compositor->display);
+  compositor->repairing = FALSE;
+  finish_frame (compositor, g_get_monotonic_time () - start);
+
+  /* Outputs whose refresh hasn't come yet, damage that came in after its
+     output was painted, or a heatmap that hasn't faded out yet, need
+     another frame */
+  for (screens = meta_display_get_screens (compositor->display);
+       screens; screens = screens->next)
+    {
+      MetaCompScreen *info = meta_screen_get_compositor_data (screens->data);
+      int i;
+
+      if (info == NULL)
+        continue;
+
+      for (i = 0; i < info->n_outputs; i++)
+        if (output_needs_frame (info, &info->outputs[i]))
+          break;
+
+      if (i < info->n_outputs || info->all_damage != NULL ||
+          info->animations != NULL)
+        {
+          add_repair (compositor->display);
+          break;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Makes sure a repaint runs by the deadline of the first output that
+   has something to paint, or by the next deadline of any output when
+   there is no damage yet (queued events, windows to repair, ...) */
+static void
+add_repair (MetaDisplay *display)
+{
+  MetaCompositorXRender *compositor = DISPLAY_COMPOSITOR (display);
+  gint64 now, deadline, idle_deadline;
+  GSList *screens;
+
+  /* Anything damaged while repairing is looked at by that frame */
+  if (compositor->repairing)
+    return;
+
+  now = g_get_monotonic_time ();
+  deadline = G_MAXINT64;
+  idle_deadline = G_MAXINT64;
+
+  for (screens = meta_display_get_screens (display);
+       screens; screens = screens->next)
+    {
+      MetaScreen *screen = (MetaScreen *) screens->data;
+      MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+      int i;
+
+      if (info == NULL)
+        continue;
+
+      update_outputs (screen);
+
+      for (i = 0; i < info->n_outputs; i++)
+        {
+          MetaCompOutput *output = &info->outputs[i];
+
+          if (output_needs_frame (info, output))
+            {
+              if (output->target_vblank == 0)
+                schedule_output (screen, output, now);
+
+              deadline = MIN (deadline,
+                              output->target_vblank - compositor->frame_budget);
+            }
+          else if (output->frame_interval != 0)
+            idle_deadline = MIN (idle_deadline,
+                                 next_vblank (output, now + compositor->frame_budget) -
+                                 compositor->frame_budget);
+        }
+    }
+
+  if (deadline == G_MAXINT64)
+    deadline = idle_deadline;
+  if (deadline == G_MAXINT64)
+    deadline = now;
+
+  /* A pending repaint is only ever moved earlier */
+  if (compositor->repaint_id > 0)
+    {
+      if (compositor->repaint_deadline <= deadline)
+        return;
+
+      g_source_remove (compositor->repaint_id);
+    }
+
+  compositor->repaint_deadline = deadline;
+  compositor->repaint_id = g_timeout_add_full (G_PRIORITY_HIGH,
+                                               MAX (deadline - now, 0) / 1000,
+                                               compositor_idle_cb, compositor,
+                                               NULL);
+}
+#endif
+
+static void
+add_damage (MetaScreen     *screen,
+            cairo_region_t *damage)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+
+  /*  dump_region ("add_damage", display, damage); */
+
+  if (info == NULL)
+    {
+      cairo_region_destroy (damage);
+      return;
+    }
+
+#ifdef USE_IDLE_REPAINT
+  {
+    int i;
+
+    /* Each output keeps its share until its own next frame, damage off
+       every output is never seen */
+    update_outputs (screen);
+
+    for (i = 0; i < info->n_outputs; i++)
+      {
+        MetaCompOutput *output = &info->outputs[i];
+        cairo_rectangle_int_t r;
+        cairo_region_t *part;
+
+        r.x = output->rect.x;
+        r.y = output->rect.y;
+        r.width = output->rect.width;
+        r.height = output->rect.height;
+
+        part = cairo_region_copy (damage);
+        cairo_region_intersect_rectangle (part, &r);
+
+        if (cairo_region_is_empty (part))
+          cairo_region_destroy (part);
+        else if (output->damage != NULL)
+          {
+            cairo_region_union (output->damage, part);
+            cairo_region_destroy (part);
+          }
+        else
+          output->damage = part;
+      }
+
+    cairo_region_destroy (damage);
+  }
+
+  add_repair (display);
+#else
+  if (info->all_damage)
+    {
+      cairo_region_union (info->all_damage, damage);
+      cairo_region_destroy (damage);
+    }
+  else
+    info->all_damage = damage;
+#endif
+}
+
+static void
+damage_rectangle (MetaScreen                  *screen,
+                  const cairo_rectangle_int_t *rect)
+{
+  if (rect->width > 0 && rect->height > 0)
+    add_damage (screen, cairo_region_create_rectangle (rect));
+}
+
+/* Steps each animation to the current time, damaging where it was and
+   where it is now drawn, and drops the ones that are over */
+static void
+advance_animations (MetaScreen *screen)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  gint64 now = g_get_monotonic_time ();
+  GList *index, *next;
+
+  for (index = info->animations; index; index = next)
+    {
+      MetaCompAnimation *anim = (MetaCompAnimation *) index->data;
+      MetaCompWindow *cw;
+      double progress;
+
+      next = index->next;
+
+      damage_rectangle (screen, &anim->rect);
+
+      progress = (double) (now - anim->start) / anim->length;
+      if (progress < 1)
+        {
+          update_animation (anim, CLAMP (progress, 0, 1));
+          damage_rectangle (screen, &anim->rect);
+          continue;
+        }
+
+      /* Over, the window shows itself again if it is still around */
+      cw = find_window_for_screen (screen, anim->id);
+      if (cw != NULL)
+        {
+          cairo_rectangle_int_t r;
+
+          cw->animating = FALSE;
+
+          r.x = anim->window_rect.x;
+          r.y = anim->window_rect.y;
+          r.width = anim->window_rect.width;
+          r.height = anim->window_rect.height;
+          damage_rectangle (screen, &r);
+        }
+
+      info->animations = g_list_delete_link (info->animations, index);
+      free_animation (screen, anim);
+    }
+}
+
+static void
+damage_screen (MetaScreen *screen)
+{
+  MetaDisplay *display = meta_screen_get_display (screen);
+  cairo_region_t *region;
+  int width, height;
+  cairo_rectangle_int_t r;
+
+  r.x = 0;
+  r.y = 0;
+  meta_screen_get_size (screen, &width, &height);
+  r.width = width;
+  r.height = height;
+
+  region = cairo_region_create_rectangle (&r);
+  dump_region ("damage_screen", display, region);
+  add_damage (screen, region);
+}
+
+static guint
+get_bypass_compositor (MetaDisplay    *display,
+                       MetaCompWindow *cw)
+{
+  MetaCompositorXRender *compositor = DISPLAY_COMPOSITOR (display);
+  gulong value;
+
+  /* The hint is set on the client, which may sit inside a frame */
+  if (meta_prop_get_cardinal (display, cw->id,
+                              compositor->atom_net_wm_bypass_compositor,
+                              &value))
+    return (guint) value;
+
+  if (cw->window && cw->window->xwindow != cw->id &&
+      meta_prop_get_cardinal (display, cw->window->xwindow,
+                              compositor->atom_net_wm_bypass_compositor,
+                              &value))
+    return (guint) value;
+
+  return BYPASS_COMPOSITOR_NO_PREFERENCE;
+}
 
-          XFixesIntersectRegion (xdisplay, cw->border_clip, cw->border_clip,
-                                 cw->border_size);
-          XFixesSetPictureClipRegion (xdisplay, root_buffer, 0, 0,
-                                      cw->border_clip);
-          if (cw->mode == WINDOW_ARGB)
-            {
-              int x, y, wid, hei;
+static gboolean
+window_can_unredirect (MetaCompWindow *cw)
+{
+  MetaDisplay *display = meta_screen_get_display (cw->screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  XRenderPictFormat *format;
 
-              x = cw->attrs.x;
-              y = cw->attrs.y;
-              wid = cw->attrs.width + cw->attrs.border_width * 2;
-              hei = cw->attrs.height + cw->attrs.border_width * 2;
+  /* Whatever is under a shaped window would show through unpainted */
+  if (cw->opacity != (guint) OPAQUE || cw->shaped ||
+      cw->bypass_compositor == BYPASS_COMPOSITOR_FORBIDDEN)
+    return FALSE;
 
-              XRenderComposite (xdisplay, PictOpOver, cw->picture,
-                                cw->alpha_pict, root_buffer, 0, 0, 0, 0,
-                                x, y, wid, hei);
-            }
-        }
+  /* A client asking for it is trusted to cover itself, even if ARGB */
+  if (cw->bypass_compositor == BYPASS_COMPOSITOR_REQUESTED)
+    return TRUE;
 
-      if (cw->border_clip)
-        {
-          XFixesDestroyRegion (xdisplay, cw->border_clip);
-          cw->border_clip = None;
-        }
-    }
+  /* Otherwise only fullscreen windows go, their frame may be ARGB but
+     then the client covers all of it */
+  if (cw->window == NULL || !cw->window->fullscreen)
+    return FALSE;
 
-  XFlush(xdisplay);
-  XFixesDestroyRegion (xdisplay, paint_region);
+  format = XRenderFindVisualFormat (xdisplay, cw->window->xvisual);
+
+  return !(format && format->type == PictTypeDirect && format->direct.alphaMask);
 }
 
-static void
-paint_all (MetaScreen   *screen,
-           XserverRegion region)
+/* Returns the window covering a whole output with nothing on top of
+   it, if there is one that may be unredirected */
+static MetaCompWindow *
+find_unredirect_window (MetaScreen *screen)
 {
   MetaCompScreen *info = meta_screen_get_compositor_data (screen);
-  MetaDisplay *display = meta_screen_get_display (screen);
-  Display *xdisplay = meta_display_get_xdisplay (display);
-  int screen_width, screen_height;
+  int i;
 
-  /* Set clipping to the given region */
-  XFixesSetPictureClipRegion (xdisplay, info->root_picture, 0, 0, region);
+  for (i = 0; i < screen->n_xinerama_infos; i++)
+    {
+      MetaRectangle *output = &screen->xinerama_infos[i].rect;
+      GList *index;
 
-  meta_screen_get_size (screen, &screen_width, &screen_height);
+      for (index = info->windows; index; index = index->next)
+        {
+          MetaCompWindow *cw = (MetaCompWindow *) index->data;
+          MetaRectangle bounds;
 
-  if (DISPLAY_COMPOSITOR (display)->show_redraw)
-    {
-      Picture overlay;
+          if (cw->attrs.map_state != IsViewable || cw->attrs.class == InputOnly)
+            continue;
 
-      dump_xserver_region ("paint_all", display, region);
+          if (cw->window && (cw->window->minimized || cw->window->hidden))
+            continue;
 
-      /* Make a random colour overlay */
-      overlay = solid_picture (display, screen, TRUE, 1, /* 0.3, alpha */
-                               ((double) (rand () % 100)) / 100.0,
-                               ((double) (rand () % 100)) / 100.0,
-                               ((double) (rand () % 100)) / 100.0);
+          bounds.x = cw->attrs.x;
+          bounds.y = cw->attrs.y;
+          bounds.width = cw->attrs.width + cw->attrs.border_width * 2;
+          bounds.height = cw->attrs.height + cw->attrs.border_width * 2;
 
-      XRenderComposite (xdisplay, PictOpOver, overlay, None, info->root_picture,
-                        0, 0, 0, 0, 0, 0, screen_width, screen_height);
-      XRenderFreePicture (xdisplay, overlay);
-      XFlush (xdisplay);
-      usleep (100 * 1000);
-    }
+          if (!meta_rectangle_overlap (&bounds, output))
+            continue;
 
-  if (info->root_buffer == None)
-    info->root_buffer = create_root_buffer (screen);
+          /* Only the topmost window on the output matters */
+          if (meta_rectangle_contains_rect (&bounds, output) &&
+              window_can_unredirect (cw))
+            return cw;
 
-  paint_windows (screen, info->windows, info->root_buffer, region);
+          break;
+        }
+    }
 
-  XFixesSetPictureClipRegion (xdisplay, info->root_buffer, 0, 0, region);
-  XRenderComposite (xdisplay, PictOpSrc, info->root_buffer, None,
-                    info->root_picture, 0, 0, 0, 0, 0, 0,
-                    screen_width, screen_height);
+  return NULL;
 }
 
+/* Cuts the unredirected window out of the overlay so that the server
+   drawn contents show through it */
 static void
-repair_screen (MetaScreen *screen)
+update_overlay_shape (MetaScreen *screen)
 {
-  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
   MetaDisplay *display = meta_screen_get_display (screen);
   Display *xdisplay = meta_display_get_xdisplay (display);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  MetaCompWindow *cw = info->unredirected;
+  cairo_rectangle_int_t r;
+  cairo_region_t *visible;
+  XserverRegion region;
+  XRectangle *rects;
+  int nrects;
 
-  if (info!=NULL && info->all_damage != None)
+  if (cw == NULL)
     {
-      meta_error_trap_push (display);
-      paint_all (screen, info->all_damage);
-      XFixesDestroyRegion (xdisplay, info->all_damage);
-      info->all_damage = None;
-      info->clip_changed = FALSE;
-      meta_error_trap_pop (display, FALSE);
+      XFixesSetWindowShapeRegion (xdisplay, info->output, ShapeBounding,
+                                  0, 0, None);
+      return;
     }
+
+  if (cw->border_size == NULL)
+    cw->border_size = border_size (cw);
+
+  r.x = 0;
+  r.y = 0;
+  meta_screen_get_size (screen, &r.width, &r.height);
+
+  visible = cairo_region_create_rectangle (&r);
+  cairo_region_subtract (visible, cw->border_size);
+
+  rects = cairo_region_to_xrectangles (visible, &nrects);
+  region = XFixesCreateRegion (xdisplay, rects, nrects);
+  XFixesSetWindowShapeRegion (xdisplay, info->output, ShapeBounding,
+                              0, 0, region);
+
+  XFixesDestroyRegion (xdisplay, region);
+  g_free (rects);
+  cairo_region_destroy (visible);
 }
 
 static void
-repair_display (MetaDisplay *display)
+set_unredirected_window (MetaScreen     *screen,
+                         MetaCompWindow *cw)
 {
-  GSList *screens = meta_display_get_screens (display);
-  MetaCompositorXRender *compositor = DISPLAY_COMPOSITOR (display);
+  MetaDisplay *display = meta_screen_get_display (screen);
+  Display *xdisplay = meta_display_get_xdisplay (display);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  MetaCompWindow *old = info->unredirected;
 
-#ifdef USE_IDLE_REPAINT
-  if (compositor->use_idle_paint && compositor->repaint_id > 0)
+  if (old == cw)
+    return;
+
+  if (old != NULL)
     {
-      g_source_remove (compositor->repaint_id);
-      compositor->repaint_id = 0;
-    }
-#endif
+      meta_verbose ("Redirecting window 0x%lx\n", old->id);
+      XCompositeRedirectWindow (xdisplay, old->id, CompositeRedirectManual);
+      old->unredirected = FALSE;
+      old->damaged = FALSE;
 
-  for (; screens; screens = screens->next)
-    repair_screen ((MetaScreen *) screens->data);
-}
+      /* The window got a fresh backing pixmap */
+      free_window_pixmap (old);
+    }
 
-#ifdef USE_IDLE_REPAINT
-static gboolean
-compositor_idle_cb (gpointer data)
-{
-  MetaCompositorXRender *compositor = (MetaCompositorXRender *) data;
-  if (compositor->use_idle_paint) 
+  if (cw != NULL)
     {
-      compositor->repaint_id = 0;
+      meta_verbose ("Unredirecting window 0x%lx\n", cw->id);
+      XCompositeUnredirectWindow (xdisplay, cw->id, CompositeRedirectManual);
+      cw->unredirected = TRUE;
+      free_window_pixmap (cw);
     }
 
-  repair_display (compositor->display);
-
-  return compositor->use_idle_paint ? FALSE : G_SOURCE_CONTINUE;
+  info->unredirected = cw;
+  info->occlusion_dirty = TRUE;
+  update_overlay_shape (screen);
+  damage_screen (screen);
 }
 
 static void
-add_repair (MetaDisplay *display)
+update_unredirection (MetaScreen *screen)
 {
-  MetaCompositorXRender *compositor = DISPLAY_COMPOSITOR (display);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
 
-  if (compositor->repaint_id > 0)
+  if (!info->allow_unredirect)
     return;
 
-  const char* mode = g_getenv("META_IDLE_PAINT_MODE");
-  compositor->use_idle_paint = (mode == NULL || !g_str_equal(mode, "fixed"));
+  set_unredirected_window (screen, find_unredirect_window (screen));
+}
 
-  if (compositor->use_idle_paint) 
-    {
-      compositor->repaint_id = g_timeout_add_full (G_PRIORITY_HIGH, 5,
-                                                compositor_idle_cb, compositor,
-                                                NULL);
-    }
-  else
-    {
-      const char* fps_str = g_getenv("META_IDLE_PAINT_FPS");
-      compositor->fps = fps_str == NULL ? 30 : (guint)atoi(fps_str);
-      guint interval = 1000 / compositor->fps;
-      compositor->repaint_id = g_timeout_add_full (G_PRIORITY_HIGH, interval,
-                                                   compositor_idle_cb, compositor,
-                                                   NULL);
-    }
+static gboolean
+window_is_occluder (MetaCompWindow *cw)
+{
+  if (cw->attrs.map_state != IsViewable || cw->attrs.class == InputOnly)
+    return FALSE;
+
+  if (cw->window && (cw->window->minimized || cw->window->hidden))
+    return FALSE;
+
+  /* The server draws it itself, whatever is under it never shows */
+  if (cw->unredirected)
+    return TRUE;
+
+  /* Windows that haven't been painted yet don't hide anything */
+  return cw->damaged && cw->mode == WINDOW_SOLID;
 }
-#endif
 
 static void
-add_damage (MetaScreen     *screen,
-            XserverRegion   damage)
+update_occlusion (MetaScreen *screen)
 {
-  MetaDisplay *display = meta_screen_get_display (screen);
-  Display *xdisplay = meta_display_get_xdisplay (display);
   MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  cairo_region_t *above;
+  GList *index;
 
-  /*  dump_xserver_region ("add_damage", display, damage); */
+  above = cairo_region_create ();
 
-  if (info != NULL && info->all_damage)
+  for (index = info->windows; index; index = index->next)
     {
-      XFixesUnionRegion (xdisplay, info->all_damage, info->all_damage, damage);
-      XFixesDestroyRegion (xdisplay, damage);
+      MetaCompWindow *cw = (MetaCompWindow *) index->data;
+
+      if (cw->occlusion)
+        cairo_region_destroy (cw->occlusion);
+      cw->occlusion = cairo_region_reference (above);
+
+      if (window_is_occluder (cw))
+        {
+          cairo_region_t *next;
+
+          if (cw->border_size == NULL)
+            cw->border_size = border_size (cw);
+
+          next = cairo_region_copy (above);
+          cairo_region_union (next, cw->border_size);
+          cairo_region_destroy (above);
+          above = next;
+        }
     }
-  else
-    info->all_damage = damage;
 
-#ifdef USE_IDLE_REPAINT
-  add_repair (display);
-#endif
+  cairo_region_destroy (above);
+  info->occlusion_dirty = FALSE;
 }
 
+/* Drops the part of a window's damage that is hidden under opaque
+   windows. Anything that uncovers it damages its own area, so what is
+   dropped here gets repainted then. */
 static void
-damage_screen (MetaScreen *screen)
+cull_occluded_damage (MetaCompWindow *cw,
+                      cairo_region_t *damage)
 {
-  MetaDisplay *display = meta_screen_get_display (screen);
-  Display *xdisplay = meta_display_get_xdisplay (display);
-  XserverRegion region;
-  int width, height;
-  XRectangle r;
+  MetaCompScreen *info = meta_screen_get_compositor_data (cw->screen);
+  guint64 area;
 
-  r.x = 0;
-  r.y = 0;
-  meta_screen_get_size (screen, &width, &height);
-  r.width = width;
-  r.height = height;
+  if (info == NULL)
+    return;
 
-  region = XFixesCreateRegion (xdisplay, &r, 1);
-  dump_xserver_region ("damage_screen", display, region);
-  add_damage (screen, region);
+  if (info->occlusion_dirty || cw->occlusion == NULL)
+    update_occlusion (cw->screen);
+
+  area = region_area (damage);
+  info->damage_area += area;
+
+  if (cairo_region_is_empty (cw->occlusion))
+    return;
+
+  cairo_region_subtract (damage, cw->occlusion);
+  info->culled_area += area - region_area (damage);
 }
 
 static void
@@ -1669,7 +3851,17 @@ repair_win (MetaCompWindow *cw)
   MetaScreen *screen = cw->screen;
   MetaDisplay *display = meta_screen_get_display (screen);
   Display *xdisplay = meta_display_get_xdisplay (display);
-  XserverRegion parts;
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  cairo_region_t *parts;
+
+  if (cw->unredirected)
+    {
+      /* Nothing to repair, the server draws this window itself */
+      meta_error_trap_push (display);
+      XDamageSubtract (xdisplay, cw->damage, None, None);
+      meta_error_trap_pop (display, FALSE);
+      return;
+    }
 
   meta_error_trap_push (display);
 
@@ -1684,32 +3876,99 @@ repair_win (MetaCompWindow *cw)
     }
   else
     {
-      parts = XFixesCreateRegion (xdisplay, 0, 0);
-      XDamageSubtract (xdisplay, cw->damage, None, parts);
-      XFixesTranslateRegion (xdisplay, parts,
-                             cw->attrs.x + cw->attrs.border_width,
-                             cw->attrs.y + cw->attrs.border_width);
+      XserverRegion xparts;
+
+      xparts = XFixesCreateRegion (xdisplay, 0, 0);
+      XDamageSubtract (xdisplay, cw->damage, None, xparts);
+      parts = xserver_region_to_cairo_region (xdisplay, xparts);
+      XFixesDestroyRegion (xdisplay, xparts);
+
+      cairo_region_translate (parts,
+                              cw->attrs.x + cw->attrs.border_width,
+                              cw->attrs.y + cw->attrs.border_width);
     }
 #endif
 
   meta_error_trap_pop (display, FALSE);
-  
-  dump_xserver_region ("repair_win", display, parts);
-  add_damage (screen, parts);
-  cw->damaged = TRUE;
 
-  if (parts) {
-      Display *xdisplay = meta_display_get_xdisplay (display);
-      int nrects;
+  dump_region ("repair_win", display, parts);
+
+  if (!cairo_region_is_empty (parts))
+    {
       XRectangle *rects;
-      XRectangle bounds;
+      int nrects;
 
-      rects = XFixesFetchRegionAndBounds (xdisplay, parts, &nrects, &bounds);
-      if (nrects > 0) {
-          deepin_message_hub_window_damaged(cw->window, rects, nrects);
-      }
-      XFree (rects);
-  }
+      rects = cairo_region_to_xrectangles (parts, &nrects);
+      deepin_message_hub_window_damaged (cw->window, rects, nrects);
+      g_free (rects);
+    }
+
+  if (!cw->damaged)
+    {
+      /* It gets painted from now on and may hide the ones below */
+      cw->damaged = TRUE;
+
+      if (info != NULL)
+        info->occlusion_dirty = TRUE;
+    }
+
+  cull_occluded_damage (cw, parts);
+
+  /* Nothing visible changed, don't wake the repaint up for it */
+  if (cairo_region_is_empty (parts))
+    {
+      cairo_region_destroy (parts);
+      return;
+    }
+
+  add_damage (screen, parts);
+}
+
+/* The damage of a window is only fetched once per frame, right before
+   painting. Until then the server sends no further DamageNotify for it,
+   however often the client draws */
+static void
+queue_repair_win (MetaCompWindow *cw)
+{
+  MetaScreen *screen = cw->screen;
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+
+  if (info == NULL)
+    {
+      repair_win (cw);
+      return;
+    }
+
+  if (!cw->repair_pending)
+    {
+      cw->repair_pending = TRUE;
+      info->pending_repairs = g_slist_prepend (info->pending_repairs, cw);
+    }
+
+#ifdef USE_IDLE_REPAINT
+  add_repair (meta_screen_get_display (screen));
+#endif
+}
+
+static void
+flush_pending_repairs (MetaScreen *screen)
+{
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  GSList *pending, *l;
+
+  /* repair_win can't queue anything, but take the list first anyway */
+  pending = info->pending_repairs;
+  info->pending_repairs = NULL;
+
+  for (l = pending; l; l = l->next)
+    {
+      MetaCompWindow *cw = (MetaCompWindow *) l->data;
+
+      cw->repair_pending = FALSE;
+      repair_win (cw);
+    }
+
+  g_slist_free (pending);
 }
 
 static void
@@ -1739,58 +3998,45 @@ free_win (MetaCompWindow *cw,
       cw->picture = None;
     }
 
-  if (cw->shadow)
-    {
-      XRenderFreePicture (xdisplay, cw->shadow);
-      cw->shadow = None;
-    }
-
-  if (cw->alpha_pict)
-    {
-      XRenderFreePicture (xdisplay, cw->alpha_pict);
-      cw->alpha_pict = None;
-    }
-
-  if (cw->shadow_pict)
-    {
-      XRenderFreePicture (xdisplay, cw->shadow_pict);
-      cw->shadow_pict = None;
-    }
+  free_window_shadow (cw);
 
-  /**
-   * FIXME: Destroy border_size and window_size may crash (e.g QQ snapshot window)
-   * and I don't know why
-   */
-  meta_error_trap_push (display);
+  /* Shared with the other windows, the screen frees it */
+  cw->alpha_pict = None;
 
   if (cw->border_size)
     {
-      XFixesDestroyRegion (xdisplay, cw->border_size);
-      cw->border_size = None;
+      cairo_region_destroy (cw->border_size);
+      cw->border_size = NULL;
     }
 
   if (cw->window_size)
     {
-      XFixesDestroyRegion (xdisplay, cw->window_size);
-      cw->window_size = None;
+      cairo_region_destroy (cw->window_size);
+      cw->window_size = NULL;
     }
 
-  meta_error_trap_pop (display, FALSE);
-
   if (cw->border_clip)
     {
-      XFixesDestroyRegion (xdisplay, cw->border_clip);
-      cw->border_clip = None;
+      cairo_region_destroy (cw->border_clip);
+      cw->border_clip = NULL;
     }
 
   if (cw->extents)
     {
-      XFixesDestroyRegion (xdisplay, cw->extents);
-      cw->extents = None;
+      cairo_region_destroy (cw->extents);
+      cw->extents = NULL;
+    }
+
+  if (cw->occlusion)
+    {
+      cairo_region_destroy (cw->occlusion);
+      cw->occlusion = NULL;
     }
 
   if (destroy)
     {
+      free_shape_rects (cw);
+
       if (cw->damage != None) {
         meta_error_trap_push (display);
         XDamageDestroy (xdisplay, cw->damage);
@@ -1814,20 +4060,19 @@ map_win (MetaDisplay *display,
          Window       id)
 {
   MetaCompWindow *cw = find_window_for_screen (screen, id);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
   Display *xdisplay = meta_display_get_xdisplay (display);
 
   if (cw == NULL)
     return;
 
   meta_verbose ("%s window %p\n", __func__, id);
-  /* The reason we deallocate this here and not in unmap
-     is so that we will still have a valid pixmap for
-     whenever the window is unmapped */
+  /* The pixmap is kept through unmap so we still have the contents of
+     the unmapped window. Now the server has given the window a new one,
+     but the old pixmap and picture are only replaced when the window
+     gets painted, in case it is unmapped again before that */
   if (cw->back_pixmap)
-    {
-      XFreePixmap (xdisplay, cw->back_pixmap);
-      cw->back_pixmap = None;
-    }
+    cw->pixmap_state = PIXMAP_STALE;
 
   if (cw->shaded_back_pixmap)
     {
@@ -1837,6 +4082,9 @@ map_win (MetaDisplay *display,
 
   cw->attrs.map_state = IsViewable;
   cw->damaged = FALSE;
+
+  if (info != NULL)
+    info->occlusion_dirty = TRUE;
 }
 
 static void
@@ -1858,15 +4106,29 @@ unmap_win (MetaDisplay *display,
   cw->attrs.map_state = IsUnmapped;
   cw->damaged = FALSE;
 
-  if (cw->extents != None)
+  if (cw->extents != NULL)
     {
-      dump_xserver_region ("unmap_win", display, cw->extents);
+      dump_region ("unmap_win", display, cw->extents);
       add_damage (screen, cw->extents);
-      cw->extents = None;
+      cw->extents = NULL;
+    }
+
+  /* The picture, shadow and shape regions don't depend on the window
+     being mapped, and are kept for when it comes back */
+  if (cw->border_clip)
+    {
+      cairo_region_destroy (cw->border_clip);
+      cw->border_clip = NULL;
+    }
+
+  if (cw->occlusion)
+    {
+      cairo_region_destroy (cw->occlusion);
+      cw->occlusion = NULL;
     }
 
-  free_win (cw, FALSE);
   info->clip_changed = TRUE;
+  info->occlusion_dirty = TRUE;
 }
 
 static void
@@ -1876,12 +4138,10 @@ determine_mode (MetaDisplay    *display,
 {
   XRenderPictFormat *format;
   Display *xdisplay = meta_display_get_xdisplay (display);
+  MetaCompScreen *info;
 
-  if (cw->alpha_pict)
-    {
-      XRenderFreePicture (xdisplay, cw->alpha_pict);
-      cw->alpha_pict = None;
-    }
+  /* The opacity may have changed, paint_windows looks it up again */
+  cw->alpha_pict = None;
 
   if (cw->shadow_pict)
     {
@@ -1900,13 +4160,16 @@ determine_mode (MetaDisplay    *display,
   else
     cw->mode = WINDOW_SOLID;
 
+  info = meta_screen_get_compositor_data (screen);
+  if (info != NULL)
+    info->occlusion_dirty = TRUE;
+
   if (cw->extents)
     {
-      XserverRegion damage;
-      damage = XFixesCreateRegion (xdisplay, NULL, 0);
-      XFixesCopyRegion (xdisplay, damage, cw->extents);
+      cairo_region_t *damage;
+      damage = cairo_region_copy (cw->extents);
 
-      dump_xserver_region ("determine_mode", display, damage);
+      dump_region ("determine_mode", display, damage);
       add_damage (screen, damage);
     }
 }
@@ -2017,6 +4280,7 @@ add_win (MetaScreen *screen,
         {
           meta_verbose ("rebind MetaWindow %p with MetaCompWindow\n", window);
           cw->window = window;
+          cw->bypass_compositor = get_bypass_compositor (display, cw);
           if (!XGetWindowAttributes (xdisplay, xwindow, &cw->attrs))
             {
               cw->shape_bounds.x = cw->attrs.x;
@@ -2048,7 +4312,13 @@ add_win (MetaScreen *screen,
   event_mask = cw->attrs.your_event_mask | PropertyChangeMask;
   XSelectInput (xdisplay, xwindow, event_mask);
 
+  /* The bounding region is cached client side, so we need to hear
+     about reshapes of frames and unmanaged windows too */
+  if (meta_display_has_shape (display))
+    XShapeSelectInput (xdisplay, xwindow, ShapeNotifyMask);
+
   cw->back_pixmap = None;
+  cw->pixmap_state = PIXMAP_NONE;
   cw->shaded_back_pixmap = None;
 
   cw->damaged = FALSE;
@@ -2066,9 +4336,9 @@ add_win (MetaScreen *screen,
 
   cw->alpha_pict = None;
   cw->shadow_pict = None;
-  cw->border_size = None;
-  cw->window_size = None;
-  cw->extents = None;
+  cw->border_size = NULL;
+  cw->window_size = NULL;
+  cw->extents = NULL;
   cw->shadow = None;
   cw->shadow_dx = 0;
   cw->shadow_dy = 0;
@@ -2093,7 +4363,11 @@ add_win (MetaScreen *screen,
     cw->opacity = (guint)value;
   }
 
-  cw->border_clip = None;
+  cw->bypass_compositor = get_bypass_compositor (display, cw);
+  cw->unredirected = FALSE;
+  cw->repair_pending = FALSE;
+
+  cw->border_clip = NULL;
 
   determine_mode (display, screen, cw);
   cw->needs_shadow = window_has_shadow (cw);
@@ -2109,6 +4383,7 @@ add_win (MetaScreen *screen,
      before it is mapped so that map_win can find it again */
   info->windows = g_list_prepend (info->windows, cw);
   g_hash_table_insert (info->windows_by_xid, (gpointer) xwindow, cw);
+  info->occlusion_dirty = TRUE;
 
   if (cw->attrs.map_state == IsViewable)
     map_win (display, screen, xwindow);
@@ -2130,11 +4405,11 @@ destroy_win (MetaDisplay *display,
 
   screen = cw->screen;
 
-  if (cw->extents != None)
+  if (cw->extents != NULL)
     {
-      dump_xserver_region ("destroy_win", display, cw->extents);
+      dump_region ("destroy_win", display, cw->extents);
       add_damage (screen, cw->extents);
-      cw->extents = None;
+      cw->extents = NULL;
     }
 
   info = meta_screen_get_compositor_data (screen);
@@ -2142,6 +4417,17 @@ destroy_win (MetaDisplay *display,
     {
       info->windows = g_list_remove (info->windows, (gconstpointer) cw);
       g_hash_table_remove (info->windows_by_xid, (gpointer) xwindow);
+      info->occlusion_dirty = TRUE;
+
+      if (cw->repair_pending)
+        info->pending_repairs = g_slist_remove (info->pending_repairs, cw);
+
+      if (info->unredirected == cw)
+        {
+          info->unredirected = NULL;
+          update_overlay_shape (screen);
+          damage_screen (screen);
+        }
     }
 
   meta_verbose ("%s: id 0x%x\n", __func__, xwindow);
@@ -2166,6 +4452,8 @@ restack_win (MetaCompWindow *cw,
       return;
     }
 
+  info->occlusion_dirty = TRUE;
+
   sibling = g_list_find (info->windows, (gconstpointer) cw);
   next = g_list_next (sibling);
   previous_above = None;
@@ -2228,26 +4516,25 @@ resize_win (MetaCompWindow *cw,
   MetaDisplay *display = meta_screen_get_display (screen);
   Display *xdisplay = meta_display_get_xdisplay (display);
   MetaCompScreen *info = meta_screen_get_compositor_data (screen);
-  XserverRegion damage;
-  XserverRegion shape;
+  cairo_region_t *damage;
   gboolean debug;
+  int dx, dy;
 
   debug = DISPLAY_COMPOSITOR (display)->debug;
 
   if (cw->extents)
     {
-      damage = XFixesCreateRegion (xdisplay, NULL, 0);
-      XFixesCopyRegion (xdisplay, damage, cw->extents);
+      damage = cairo_region_copy (cw->extents);
     }
   else
     {
-      damage = None;
+      damage = NULL;
       if (debug)
         fprintf (stderr, "no extents to damage !\n");
     }
 
   /*  { // Damage whole screen each time ! ;-)
-    XRectangle r;
+    cairo_rectangle_int_t r;
 
     r.x = 0;
     r.y = 0;
@@ -2255,9 +4542,12 @@ resize_win (MetaCompWindow *cw,
     fprintf (stderr, "Damage whole screen %d,%d (%d %d)\n",
              r.x, r.y, r.width, r.height);
 
-    damage = XFixesCreateRegion (xdisplay, &r, 1);
+    damage = cairo_region_create_rectangle (&r);
     } */
 
+  dx = x - cw->attrs.x;
+  dy = y - cw->attrs.y;
+
   cw->attrs.x = x;
   cw->attrs.y = y;
 
@@ -2291,12 +4581,36 @@ resize_win (MetaCompWindow *cw,
           cw->picture = None;
         }
 
-      if (cw->shadow)
+      cw->pixmap_state = PIXMAP_NONE;
+
+      free_window_shadow (cw);
+    }
+
+  /* The cached regions only depend on the window's own geometry, so
+     a plain move is a translation and anything else refetches them */
+  if (cw->attrs.width != width || cw->attrs.height != height ||
+      cw->attrs.border_width != border_width)
+    {
+      if (cw->border_size)
+        {
+          cairo_region_destroy (cw->border_size);
+          cw->border_size = NULL;
+        }
+
+      if (cw->window_size)
         {
-          XRenderFreePicture (xdisplay, cw->shadow);
-          cw->shadow = None;
+          cairo_region_destroy (cw->window_size);
+          cw->window_size = NULL;
         }
     }
+  else if (dx != 0 || dy != 0)
+    {
+      if (cw->border_size)
+        cairo_region_translate (cw->border_size, dx, dy);
+
+      if (cw->window_size)
+        cairo_region_translate (cw->window_size, dx, dy);
+    }
 
   cw->attrs.width = width;
   cw->attrs.height = height;
@@ -2304,7 +4618,7 @@ resize_win (MetaCompWindow *cw,
   cw->attrs.override_redirect = override_redirect;
 
   if (cw->extents)
-    XFixesDestroyRegion (xdisplay, cw->extents);
+    cairo_region_destroy (cw->extents);
 
   cw->extents = win_extents (cw);
 
@@ -2313,27 +4627,36 @@ resize_win (MetaCompWindow *cw,
       if (debug)
         fprintf (stderr, "Inexplicable intersection with new extents!\n");
 
-      XFixesUnionRegion (xdisplay, damage, damage, cw->extents);
+      cairo_region_union (damage, cw->extents);
     }
   else
     {
-      damage = XFixesCreateRegion (xdisplay, NULL, 0);
-      XFixesCopyRegion (xdisplay, damage, cw->extents);
+      damage = cairo_region_copy (cw->extents);
     }
 
-  shape = XFixesCreateRegion (xdisplay, &cw->shape_bounds, 1);
-  XFixesUnionRegion (xdisplay, damage, damage, shape);
-  XFixesDestroyRegion (xdisplay, shape);
+  {
+    cairo_rectangle_int_t shape;
+
+    shape.x = cw->shape_bounds.x;
+    shape.y = cw->shape_bounds.y;
+    shape.width = cw->shape_bounds.width;
+    shape.height = cw->shape_bounds.height;
+    cairo_region_union_rectangle (damage, &shape);
+  }
 
-  dump_xserver_region ("resize_win", display, damage);
+  dump_region ("resize_win", display, damage);
   add_damage (screen, damage);
 
-  XFixesDestroyRegion (xdisplay, cw->extents);
-  cw->extents = None;
+  if (cw->unredirected)
+    update_overlay_shape (screen);
+
+  cairo_region_destroy (cw->extents);
+  cw->extents = NULL;
 
   if (info != NULL)
     {
       info->clip_changed = TRUE;
+      info->occlusion_dirty = TRUE;
     }
 }
 
@@ -2405,7 +4728,7 @@ process_configure_notify (MetaCompositorXRender  *compositor,
         {
           fprintf (stderr, "configure notify %d %d %d\n", cw->damaged,
                    cw->shaped, cw->needs_shadow);
-          dump_xserver_region ("\textents", display, cw->extents);
+          dump_region ("\textents", display, cw->extents);
           fprintf (stderr, "\txy (%d %d), wh (%d %d)\n",
                    event->x, event->y, event->width, event->height);
         }
@@ -2431,10 +4754,116 @@ process_configure_notify (MetaCompositorXRender  *compositor,
           info->root_buffer = None;
         }
 
+#ifdef HAVE_PRESENT
+      if (info != NULL)
+        free_back_buffers (screen);
+#endif
+
+#ifdef USE_IDLE_REPAINT
+      /* The outputs may have changed mode, pick up the new refresh rates */
+      compositor->frame_interval = 0;
+      if (info != NULL)
+        {
+          int i;
+
+          for (i = 0; i < info->n_outputs; i++)
+            info->outputs[i].frame_interval = 0;
+        }
+#endif
+
       damage_screen (screen);
     }
 }
 
+#ifdef HAVE_PRESENT
+static void
+process_present_idle (MetaCompositorXRender   *compositor,
+                      XPresentIdleNotifyEvent *event)
+{
+  GSList *screens;
+
+  for (screens = meta_display_get_screens (compositor->display);
+       screens; screens = screens->next)
+    {
+      MetaCompScreen *info = meta_screen_get_compositor_data (screens->data);
+      int i;
+
+      if (info == NULL)
+        continue;
+
+      for (i = 0; i < BACK_BUFFER_COUNT; i++)
+        if (info->back_buffers[i].pixmap == event->pixmap)
+          {
+            info->back_buffers[i].busy = FALSE;
+            return;
+          }
+    }
+}
+
+static void
+process_present (MetaCompositorXRender *compositor,
+                 XGenericEventCookie   *cookie)
+{
+  XPresentCompleteNotifyEvent *event;
+  GSList *screens;
+  gint64 ust;
+
+  /* GDK has already fetched the data of generic events for us */
+  if (cookie->data == NULL)
+    return;
+
+  if (cookie->evtype == PresentIdleNotify)
+    {
+      process_present_idle (compositor,
+                            (XPresentIdleNotifyEvent *) cookie->data);
+      return;
+    }
+
+  if (cookie->evtype != PresentCompleteNotify)
+    return;
+
+  /* Both the frames we present and the vblank notifies we ask for in
+     finish_frame tell when a vblank happened */
+  event = (XPresentCompleteNotifyEvent *) cookie->data;
+  if (event->kind != PresentCompleteKindNotifyMSC &&
+      event->kind != PresentCompleteKindPixmap)
+    return;
+
+  /* The UST is on the monotonic clock on every server we care about,
+     don't let a server using another clock throw the frame clock off */
+  ust = (gint64) event->ust;
+  if (ABS (g_get_monotonic_time () - ust) > G_USEC_PER_SEC)
+    return;
+
+  for (screens = meta_display_get_screens (compositor->display);
+       screens; screens = screens->next)
+    {
+      MetaCompScreen *info = meta_screen_get_compositor_data (screens->data);
+      MetaCompOutput *largest = NULL;
+      int i;
+
+      if (info == NULL || info->output != event->window)
+        continue;
+
+      /* The server follows the CRTC showing most of the window, for the
+         overlay window that is the largest output */
+      for (i = 0; i < info->n_outputs; i++)
+        {
+          MetaCompOutput *output = &info->outputs[i];
+
+          if (largest == NULL ||
+              meta_rectangle_area (&output->rect) >
+              meta_rectangle_area (&largest->rect))
+            largest = output;
+        }
+
+      if (largest != NULL)
+        largest->last_vblank = ust;
+      break;
+    }
+}
+#endif
+
 static void
 process_property_notify (MetaCompositorXRender *compositor,
                          XPropertyEvent        *event)
@@ -2504,14 +4933,10 @@ process_property_notify (MetaCompositorXRender *compositor,
       determine_mode (display, cw->screen, cw);
       cw->needs_shadow = window_has_shadow (cw);
 
-      if (cw->shadow)
-        {
-          XRenderFreePicture (xdisplay, cw->shadow);
-          cw->shadow = None;
-        }
+      free_window_shadow (cw);
 
       if (cw->extents)
-        XFixesDestroyRegion (xdisplay, cw->extents);
+        cairo_region_destroy (cw->extents);
       cw->extents = win_extents (cw);
 
       cw->damaged = TRUE;
@@ -2522,6 +4947,24 @@ process_property_notify (MetaCompositorXRender *compositor,
       return;
     }
 
+  if (event->atom == compositor->atom_net_wm_bypass_compositor)
+    {
+      MetaCompWindow *cw = find_window_in_display (display, event->window);
+
+      if (!cw)
+        cw = find_window_for_child_window_in_display (display, event->window);
+
+      if (!cw)
+        return;
+
+      cw->bypass_compositor = get_bypass_compositor (display, cw);
+#ifdef USE_IDLE_REPAINT
+      add_repair (display);
+#endif
+
+      return;
+    }
+
   if (event->atom == compositor->atom_net_wm_window_type) {
     MetaCompWindow *cw = find_window_in_display (display, event->window);
 
@@ -2540,12 +4983,11 @@ expose_area (MetaScreen *screen,
              int         nrects)
 {
   MetaDisplay *display = meta_screen_get_display (screen);
-  Display *xdisplay = meta_display_get_xdisplay (display);
-  XserverRegion region;
+  cairo_region_t *region;
 
-  region = XFixesCreateRegion (xdisplay, rects, nrects);
+  region = xrectangles_to_cairo_region (rects, nrects);
 
-  dump_xserver_region ("expose_area", display, region);
+  dump_region ("expose_area", display, region);
   add_damage (screen, region);
 }
 
@@ -2658,7 +5100,7 @@ process_damage (MetaCompositorXRender *compositor,
   if (cw == NULL)
     return;
 
-  repair_win (cw);
+  queue_repair_win (cw);
 }
 
 static void
@@ -2673,6 +5115,18 @@ process_shape (MetaCompositorXRender *compositor,
 
   if (event->kind == ShapeBounding)
     {
+      gboolean changed;
+
+      /* Some clients set the same shape many times a second, only a real
+         change is worth new regions and a repaint */
+      if (event->shaped)
+        changed = fetch_shape_rects (cw) || !cw->shaped;
+      else
+        {
+          changed = cw->shaped;
+          free_shape_rects (cw);
+        }
+
       if (!event->shaped && cw->shaped)
         cw->shaped = FALSE;
 
@@ -2694,6 +5148,25 @@ process_shape (MetaCompositorXRender *compositor,
           cw->shape_bounds.height = cw->attrs.height;
         }
 
+      if (!changed)
+        {
+          compositor->shapes_unchanged++;
+          return;
+        }
+
+      /* The cached bounding region is stale now */
+      if (cw->border_size)
+        {
+          cairo_region_destroy (cw->border_size);
+          cw->border_size = NULL;
+        }
+
+      if (cw->window_size)
+        {
+          cairo_region_destroy (cw->window_size);
+          cw->window_size = NULL;
+        }
+
       resize_win (cw, cw->attrs.x, cw->attrs.y,
                   event->width + event->x, event->height + event->y,
                   cw->attrs.border_width, cw->attrs.override_redirect);
@@ -2825,6 +5298,17 @@ xrender_manage_screen (MetaCompositor *compositor,
 
   info->output = get_output_window (screen);
 
+#ifdef HAVE_PRESENT
+  info->present_event = None;
+  if (((MetaCompositorXRender *) compositor)->have_present)
+    info->present_event = XPresentSelectInput (xdisplay, info->output,
+                                               PresentCompleteNotifyMask |
+                                               PresentIdleNotifyMask);
+  info->use_back_buffers = (info->present_event != None &&
+                            g_getenv ("META_DEBUG_NO_PRESENT") == NULL);
+  info->present_frame = 0;
+#endif
+
   pa.subwindow_mode = IncludeInferiors;
   info->root_picture = XRenderCreatePicture (xdisplay, info->output,
                                              visual_format,
@@ -2836,10 +5320,11 @@ xrender_manage_screen (MetaCompositor *compositor,
     }
 
   info->root_buffer = None;
-  info->black_picture = solid_picture (display, screen, TRUE, 1, 0, 0, 0);
+  info->solid_pictures = g_hash_table_new (g_direct_hash, g_direct_equal);
+  info->black_picture = get_solid_picture (screen, 1, 0, 0, 0);
 
   info->root_tile = None;
-  info->all_damage = None;
+  info->all_damage = NULL;
 
   info->windows = NULL;
   info->windows_by_xid = g_hash_table_new (g_direct_hash, g_direct_equal);
@@ -2850,6 +5335,20 @@ xrender_manage_screen (MetaCompositor *compositor,
   info->overlays = 0;
   info->clip_changed = TRUE;
 
+  info->unredirected = NULL;
+  info->allow_unredirect = (g_getenv ("META_DEBUG_NO_UNREDIRECT") == NULL);
+
+  info->occlusion_dirty = TRUE;
+  info->damage_area = 0;
+  info->culled_area = 0;
+  info->frame_culled_area = 0;
+  info->windows_painted = 0;
+  info->pending_repairs = NULL;
+  info->heat = NULL;
+  info->heat_cols = 0;
+  info->heat_rows = 0;
+  info->heat_warm = FALSE;
+
 #ifndef __sw_64__
   info->have_shadows = (g_getenv("META_DEBUG_NO_SHADOW") == NULL);
 #else
@@ -2890,6 +5389,13 @@ xrender_unmanage_screen (MetaCompositor *compositor,
 
   hide_overlay_window (screen, info->output);
 
+#ifdef HAVE_PRESENT
+  if (info->present_event != None)
+    XPresentFreeInput (xdisplay, info->output, info->present_event);
+
+  free_back_buffers (screen);
+#endif
+
   /* Destroy the windows */
   for (index = info->windows; index; index = index->next)
     {
@@ -2898,19 +5404,41 @@ xrender_unmanage_screen (MetaCompositor *compositor,
     }
   g_list_free (info->windows);
   g_hash_table_destroy (info->windows_by_xid);
+  g_slist_free (info->pending_repairs);
+  free_heatmap (info);
+
+  for (index = info->animations; index; index = index->next)
+    free_animation (screen, index->data);
+  g_list_free (info->animations);
+  free_outline_label (screen);
+#ifdef USE_IDLE_REPAINT
+  free_outputs (info);
+#endif
 
   if (info->root_picture)
     XRenderFreePicture (xdisplay, info->root_picture);
 
-  if (info->black_picture)
-    XRenderFreePicture (xdisplay, info->black_picture);
+  free_solid_pictures (screen);
+
+  if (info->all_damage)
+    cairo_region_destroy (info->all_damage);
 
   if (info->have_shadows)
     {
       int i;
 
       for (i = 0; i < LAST_SHADOW_TYPE; i++)
-        g_free (info->shadows[i]->gaussian_map);
+        {
+          int j;
+
+          g_free (info->shadows[i]->gaussian_map);
+
+          for (j = 0; j <= SHADOW_OPACITY_STEPS; j++)
+            {
+              if (info->shadow_tiles[i][j])
+                free_shadow_tiles (xdisplay, info->shadow_tiles[i][j]);
+            }
+        }
     }
 
   XCompositeReleaseOverlayWindow (xdisplay, info->output);
@@ -3074,6 +5602,11 @@ xrender_process_event (MetaCompositor *compositor,
         process_damage (xrc, (XDamageNotifyEvent *) event);
       else if (event->type == meta_display_get_shape_event_base (xrc->display) + ShapeNotify)
         process_shape (xrc, (XShapeEvent *) event);
+#ifdef HAVE_PRESENT
+      else if (xrc->have_present && event->type == GenericEvent &&
+               event->xcookie.extension == xrc->present_opcode)
+        process_present (xrc, &event->xcookie);
+#endif
       else
         {
           meta_error_trap_pop (xrc->display, FALSE);
@@ -3179,7 +5712,7 @@ xrender_set_active_window (MetaCompositor *compositor,
 
   if (old_focus)
     {
-      XserverRegion damage;
+      cairo_region_t *damage;
 
       /* Tear down old shadows */
       old_focus->shadow_type = META_SHADOW_MEDIUM;
@@ -3196,25 +5729,23 @@ xrender_set_active_window (MetaCompositor *compositor,
 
           if (old_focus->extents)
             {
-              damage = XFixesCreateRegion (xdisplay, NULL, 0);
-              XFixesCopyRegion (xdisplay, damage, old_focus->extents);
-              XFixesDestroyRegion (xdisplay, old_focus->extents);
+              damage = cairo_region_copy (old_focus->extents);
+              cairo_region_destroy (old_focus->extents);
             }
           else
-            damage = None;
+            damage = NULL;
 
           /* Build new extents */
           old_focus->extents = win_extents (old_focus);
 
           if (damage)
-            XFixesUnionRegion (xdisplay, damage, damage, old_focus->extents);
+            cairo_region_union (damage, old_focus->extents);
           else
             {
-              damage = XFixesCreateRegion (xdisplay, NULL, 0);
-              XFixesCopyRegion (xdisplay, damage, old_focus->extents);
+              damage = cairo_region_copy (old_focus->extents);
             }
 
-          dump_xserver_region ("resize_win", display, damage);
+          dump_region ("resize_win", display, damage);
           add_damage (screen, damage);
 
           if (info != NULL)
@@ -3226,7 +5757,7 @@ xrender_set_active_window (MetaCompositor *compositor,
 
   if (new_focus)
     {
-      XserverRegion damage;
+      cairo_region_t *damage;
 
       new_focus->shadow_type = META_SHADOW_LARGE;
       determine_mode (display, screen, new_focus);
@@ -3240,25 +5771,23 @@ xrender_set_active_window (MetaCompositor *compositor,
 
       if (new_focus->extents)
         {
-          damage = XFixesCreateRegion (xdisplay, NULL, 0);
-          XFixesCopyRegion (xdisplay, damage, new_focus->extents);
-          XFixesDestroyRegion (xdisplay, new_focus->extents);
+          damage = cairo_region_copy (new_focus->extents);
+          cairo_region_destroy (new_focus->extents);
         }
       else
-        damage = None;
+        damage = NULL;
 
       /* Build new extents */
       new_focus->extents = win_extents (new_focus);
 
       if (damage)
-        XFixesUnionRegion (xdisplay, damage, damage, new_focus->extents);
+        cairo_region_union (damage, new_focus->extents);
       else
         {
-          damage = XFixesCreateRegion (xdisplay, NULL, 0);
-          XFixesCopyRegion (xdisplay, damage, new_focus->extents);
+          damage = cairo_region_copy (new_focus->extents);
         }
 
-      dump_xserver_region ("resize_win", display, damage);
+      dump_region ("resize_win", display, damage);
       add_damage (screen, damage);
 
       if (info != NULL)
@@ -3304,6 +5833,307 @@ xrender_unmaximize_window (MetaCompositor *compositor,
 #endif
 }
 
+static int
+compare_doubles (gconstpointer a,
+                 gconstpointer b)
+{
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+
+  return (da > db) - (da < db);
+}
+
+/* Sorts values and adds their percentiles to builder as name_p50,
+   name_p90, name_p99 and name_max */
+static void
+add_percentiles (GVariantBuilder *builder,
+                 const char      *name,
+                 double          *values,
+                 guint            n_values)
+{
+  static const struct { const char *suffix; guint percent; } percentiles[] = {
+    { "p50", 50 }, { "p90", 90 }, { "p99", 99 }, { "max", 100 }
+  };
+  guint i;
+
+  qsort (values, n_values, sizeof (double), compare_doubles);
+
+  for (i = 0; i < G_N_ELEMENTS (percentiles); i++)
+    {
+      char *key = g_strdup_printf ("%s_%s", name, percentiles[i].suffix);
+      guint index = (n_values - 1) * percentiles[i].percent / 100;
+
+      g_variant_builder_add (builder, "{sd}", key, values[index]);
+      g_free (key);
+    }
+}
+
+static GVariant *
+xrender_get_frame_stats (MetaCompositor *compositor,
+                         guint           since)
+{
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+  MetaCompositorXRender *xrc = (MetaCompositorXRender *) compositor;
+  GVariantBuilder builder;
+  double *paint_time, *damaged_area, *windows, *requests;
+  double culled_area = 0;
+  guint i, n, first, late = 0;
+
+  /* Frames painted after @since that are still in the ring */
+  n = xrc->n_frames - MIN (since, xrc->n_frames);
+  n = MIN (n, FRAME_STATS_HISTORY);
+  first = xrc->n_frames - n;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sd}"));
+  g_variant_builder_add (&builder, "{sd}", "frames", (double) n);
+  g_variant_builder_add (&builder, "{sd}", "frames_total",
+                         (double) xrc->n_frames);
+  g_variant_builder_add (&builder, "{sd}", "late_frames_total",
+                         (double) xrc->n_late_frames);
+  g_variant_builder_add (&builder, "{sd}", "pixmaps_named_total",
+                         (double) xrc->pixmaps_named);
+  g_variant_builder_add (&builder, "{sd}", "pictures_created_total",
+                         (double) xrc->pictures_created);
+  g_variant_builder_add (&builder, "{sd}", "shadows_created_total",
+                         (double) xrc->shadows_created);
+  g_variant_builder_add (&builder, "{sd}", "shapes_unchanged_total",
+                         (double) xrc->shapes_unchanged);
+
+  if (n == 0)
+    return g_variant_builder_end (&builder);
+
+  paint_time = g_new (double, n);
+  damaged_area = g_new (double, n);
+  windows = g_new (double, n);
+  requests = g_new (double, n);
+
+  for (i = 0; i < n; i++)
+    {
+      MetaFrameStats *stats = &xrc->frame_stats[(first + i) % FRAME_STATS_HISTORY];
+
+      paint_time[i] = stats->paint_time / 1000.0;
+      damaged_area[i] = stats->damaged_area;
+      windows[i] = stats->windows_painted;
+      requests[i] = stats->requests;
+      culled_area += stats->culled_area;
+
+      if (stats->late)
+        late++;
+    }
+
+  add_percentiles (&builder, "paint_time_ms", paint_time, n);
+  add_percentiles (&builder, "damaged_area", damaged_area, n);
+  add_percentiles (&builder, "windows_painted", windows, n);
+  add_percentiles (&builder, "requests", requests, n);
+  g_variant_builder_add (&builder, "{sd}", "culled_area", culled_area);
+  g_variant_builder_add (&builder, "{sd}", "late_frames", (double) late);
+#ifdef USE_IDLE_REPAINT
+  g_variant_builder_add (&builder, "{sd}", "refresh_interval_ms",
+                         xrc->frame_interval / 1000.0);
+#endif
+
+  g_free (paint_time);
+  g_free (damaged_area);
+  g_free (windows);
+  g_free (requests);
+
+  return g_variant_builder_end (&builder);
+#else
+  return NULL;
+#endif
+}
+
+static void
+xrender_set_show_redraw (MetaCompositor *compositor,
+                         gboolean        show)
+{
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+  MetaCompositorXRender *xrc = (MetaCompositorXRender *) compositor;
+  GSList *screens;
+
+  if (xrc->show_redraw == !!show)
+    return;
+
+  xrc->show_redraw = !!show;
+
+  /* Start from a clean map, or get rid of the one on screen */
+  for (screens = meta_display_get_screens (xrc->display);
+       screens; screens = screens->next)
+    {
+      MetaScreen *screen = (MetaScreen *) screens->data;
+      MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+
+      if (info == NULL)
+        continue;
+
+      free_heatmap (info);
+      damage_screen (screen);
+    }
+#endif
+}
+
+static gboolean
+xrender_run_effect (MetaCompositor       *compositor,
+                    MetaWindow           *window,
+                    MetaCompositorEffect  effect,
+                    MetaRectangle        *window_rect,
+                    MetaRectangle        *icon_rect)
+{
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+  MetaCompositorXRender *xrc = (MetaCompositorXRender *) compositor;
+  MetaScreen *screen = meta_window_get_screen (window);
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+  Display *xdisplay = meta_display_get_xdisplay (xrc->display);
+  MetaFrame *frame = meta_window_get_frame (window);
+  Window xid = frame ? meta_frame_get_xwindow (frame) : meta_window_get_xwindow (window);
+  XRenderPictFormat *format;
+  MetaCompAnimation *anim;
+  MetaCompWindow *cw;
+  GList *index;
+
+  if (info == NULL)
+    return FALSE;
+
+  cw = find_window_for_screen (screen, xid);
+  if (cw == NULL)
+    return FALSE;
+
+  /* Only the window pixmap outlives an unmap or a destroy */
+  if (cw->back_pixmap == None && cw->picture == None &&
+      cw->attrs.map_state == IsViewable)
+    cw->picture = get_window_picture (cw);
+
+  format = get_window_format (cw);
+  if (cw->back_pixmap == None || format == NULL)
+    return FALSE;
+
+  anim = g_slice_new0 (MetaCompAnimation);
+  anim->id = xid;
+  anim->effect = effect;
+  anim->width = cw->attrs.width + cw->attrs.border_width * 2;
+  anim->height = cw->attrs.height + cw->attrs.border_width * 2;
+
+  meta_error_trap_push (xrc->display);
+  anim->picture = XRenderCreatePicture (xdisplay, cw->back_pixmap, format,
+                                        0, NULL);
+  XRenderSetPictureFilter (xdisplay, anim->picture, FilterBilinear, NULL, 0);
+  if (meta_error_trap_pop_with_return (xrc->display, FALSE) != 0)
+    {
+      anim->picture = None;
+      free_animation (screen, anim);
+      return FALSE;
+    }
+
+  anim->window_rect.x = cw->attrs.x;
+  anim->window_rect.y = cw->attrs.y;
+  anim->window_rect.width = anim->width;
+  anim->window_rect.height = anim->height;
+  anim->icon_rect = anim->window_rect;
+
+  /* We are handed the outer rect, which leaves out the invisible
+     borders of the frame or the client side frame extents; the window
+     picture has them, so find where it sits around the outer rect */
+  if (window_rect != NULL)
+    {
+      if (frame)
+        {
+          MetaFrameBorders borders;
+
+          meta_frame_calc_borders (frame, &borders);
+          anim->window_rect.x = window_rect->x - borders.invisible.left;
+          anim->window_rect.y = window_rect->y - borders.invisible.top;
+        }
+      else
+        {
+          MetaRectangle *rect = meta_window_get_rect (window);
+
+          anim->window_rect.x = rect->x;
+          anim->window_rect.y = rect->y;
+        }
+
+      anim->icon_rect = anim->window_rect;
+      if (icon_rect != NULL)
+        add_picture_margins (&anim->icon_rect, icon_rect, window_rect);
+    }
+
+  anim->start = g_get_monotonic_time ();
+  anim->length = ANIMATION_LENGTH;
+  if (g_getenv ("METACITY_DEBUG_EFFECTS"))
+    anim->length *= 10; /* slow things down */
+
+  /* A window minimized again before it was fully back, say, only keeps
+     the newest of its animations */
+  for (index = info->animations; index; index = index->next)
+    {
+      MetaCompAnimation *old = (MetaCompAnimation *) index->data;
+
+      if (old->id == xid)
+        {
+          damage_rectangle (screen, &old->rect);
+          info->animations = g_list_delete_link (info->animations, index);
+          free_animation (screen, old);
+          break;
+        }
+    }
+
+  update_animation (anim, 0);
+  info->animations = g_list_prepend (info->animations, anim);
+
+  /* The window itself is hidden until the animation is over */
+  cw->animating = TRUE;
+  damage_rectangle (screen, &anim->rect);
+  if (cw->extents == NULL)
+    cw->extents = win_extents (cw);
+  add_damage (screen, cairo_region_copy (cw->extents));
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+static gboolean
+xrender_set_outline (MetaCompositor      *compositor,
+                     MetaScreen          *screen,
+                     const MetaRectangle *rect,
+                     int                  cols,
+                     int                  rows)
+{
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+  MetaCompScreen *info = meta_screen_get_compositor_data (screen);
+
+  if (info == NULL)
+    return FALSE;
+
+  if (info->have_outline)
+    add_damage (screen, outline_region (info));
+
+  if (rect == NULL)
+    {
+      info->have_outline = FALSE;
+      free_outline_label (screen);
+      return TRUE;
+    }
+
+  info->outline.x = rect->x;
+  info->outline.y = rect->y;
+  info->outline.width = rect->width;
+  info->outline.height = rect->height;
+  info->have_outline = TRUE;
+
+  if (cols >= 0 && rows >= 0)
+    update_outline_label (screen, cols, rows);
+  else
+    free_outline_label (screen);
+
+  add_damage (screen, outline_region (info));
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
 static MetaCompositor comp_info = {
   xrender_destroy,
   xrender_manage_screen,
@@ -3317,6 +6147,10 @@ static MetaCompositor comp_info = {
   xrender_free_window,
   xrender_maximize_window,
   xrender_unmaximize_window,
+  xrender_get_frame_stats,
+  xrender_set_show_redraw,
+  xrender_run_effect,
+  xrender_set_outline,
 };
 
 MetaCompositor *
@@ -3338,7 +6172,8 @@ meta_compositor_xrender_new (MetaDisplay *display)
     "_NET_WM_WINDOW_TYPE_SPLASH",
     "_NET_WM_WINDOW_TYPE_TOOLBAR",
     "_NET_WM_WINDOW_TYPE_DROPDOWN_MENU",
-    "_NET_WM_WINDOW_TYPE_TOOLTIP"
+    "_NET_WM_WINDOW_TYPE_TOOLTIP",
+    "_NET_WM_BYPASS_COMPOSITOR"
   };
   Atom atoms[G_N_ELEMENTS(atom_names)];
   MetaCompositorXRender *xrc;
@@ -3371,12 +6206,36 @@ meta_compositor_xrender_new (MetaDisplay *display)
   xrc->atom_net_wm_window_type_toolbar = atoms[12];
   xrc->atom_net_wm_window_type_dropdown_menu = atoms[13];
   xrc->atom_net_wm_window_type_tooltip = atoms[14];
+  xrc->atom_net_wm_bypass_compositor = atoms[15];
   xrc->show_redraw = FALSE;
   xrc->debug = FALSE;
+  xrc->n_frames = 0;
+  xrc->n_late_frames = 0;
+  xrc->pixmaps_named = 0;
+  xrc->pictures_created = 0;
+  xrc->shadows_created = 0;
+  xrc->shapes_unchanged = 0;
 
 #ifdef USE_IDLE_REPAINT
   meta_verbose ("Using idle repaint\n");
   xrc->repaint_id = 0;
+  xrc->frame_interval = 0;
+  xrc->frame_budget = MIN_FRAME_BUDGET;
+  xrc->paint_time = 0;
+  xrc->target_vblank = 0;
+  xrc->repaint_deadline = 0;
+  xrc->repairing = FALSE;
+#endif
+
+#ifdef HAVE_PRESENT
+  {
+    int event_base, error_base;
+
+    xrc->have_present = XPresentQueryExtension (xdisplay, &xrc->present_opcode,
+                                                &event_base, &error_base);
+    if (xrc->have_present)
+      meta_verbose ("Following vblank with the Present extension\n");
+  }
 #endif
 
   xrc->enabled = TRUE;
@@ -179,3 +179,62 @@ meta_compositor_unmaximize_window (MetaCompositor *compositor,
     compositor->unmaximize_window (compositor, window);
 #endif
 }
+
+/* Returns a floating a{sd} dictionary with percentiles of the recent
+   frame times, damaged area, windows painted and X requests per frame.
+   Only frames painted after the frames_total given as @since count */
+GVariant *
+meta_compositor_get_frame_stats (MetaCompositor *compositor,
+                                 guint           since)
+{
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+  if (compositor && compositor->get_frame_stats)
+    return compositor->get_frame_stats (compositor, since);
+#endif
+  return g_variant_new ("a{sd}", NULL);
+}
+
+/* Overlays a fading heatmap of the repainted areas on the screen */
+void
+meta_compositor_set_show_redraw (MetaCompositor *compositor,
+                                 gboolean        show)
+{
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+  if (compositor && compositor->set_show_redraw)
+    compositor->set_show_redraw (compositor, show);
+#endif
+}
+
+/* Animates the window on screen for @effect. Returns FALSE if the
+   compositor can't, the caller is then left to draw the effect itself */
+gboolean
+meta_compositor_run_effect (MetaCompositor       *compositor,
+                            MetaWindow           *window,
+                            MetaCompositorEffect  effect,
+                            MetaRectangle        *window_rect,
+                            MetaRectangle        *icon_rect)
+{
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+  if (compositor && compositor->run_effect)
+    return compositor->run_effect (compositor, window, effect,
+                                   window_rect, icon_rect);
+#endif
+  return FALSE;
+}
+
+/* Shows the outline of a window being moved or resized at @rect, with
+   "cols x rows" in it unless they are negative, or hides it when @rect
+   is NULL. Returns FALSE if the compositor can't draw it */
+gboolean
+meta_compositor_set_outline (MetaCompositor      *compositor,
+                             MetaScreen          *screen,
+                             const MetaRectangle *rect,
+                             int                  cols,
+                             int                  rows)
+{
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+  if (compositor && compositor->set_outline)
+    return compositor->set_outline (compositor, screen, rect, cols, rows);
+#endif
+  return FALSE;
+}
@@ -9,19 +9,38 @@
  * (at your option) any later version.
  **/
 
+#define _GNU_SOURCE /* for memfd_create() */
+
 #include <config.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <stdlib.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 #include <util.h>
 #include "screen-private.h"
 #include "deepin-dbus-service.h"
 #include "deepin-background-cache.h"
+#include "deepin-window-surface-manager.h"
 #include "deepin-message-hub.h"
 #include "deepin-dbus-wm.h"
 #include "deepin-keybindings.h"
+#include "compositor.h"
 
 static DeepinDBusWm* _the_service = NULL;
 
+/* windows GetWindowThumbnail was called for, and xids of those changed
+ * since the last WindowThumbnailChanged went out */
+static GHashTable* _thumbnail_windows = NULL;
+static GHashTable* _changed_thumbnails = NULL;
+static guint _thumbnail_changed_id = 0;
+
+#define THUMBNAIL_CHANGED_INTERVAL 250 /* ms */
+
 enum ActionType
 {
     NONE = 0,
@@ -142,6 +161,11 @@ static gboolean deepin_dbus_service_handle_toggle_debug( DeepinDBusWm *object,
     }
     meta_set_debugging (new_val);
     meta_set_verbose (new_val);
+
+    /* show where the compositor repaints, to spot over-painting clients */
+    MetaDisplay* display = meta_get_display();
+    meta_compositor_set_show_redraw (display->compositor, new_val);
+
     deepin_dbus_wm_complete_toggle_debug(object, invocation);
     return TRUE;
 }
@@ -344,6 +368,199 @@ done:
     return TRUE;
 }
 
+static gboolean deepin_dbus_service_handle_get_frame_stats (
+        DeepinDBusWm *object,
+        GDBusMethodInvocation *invocation,
+        guint since, gpointer data)
+{
+    meta_verbose("%s\n", __func__);
+
+    MetaDisplay* display = meta_get_display();
+    GVariant* stats = meta_compositor_get_frame_stats (display->compositor,
+            since);
+    deepin_dbus_wm_complete_get_frame_stats (object, invocation, stats);
+    return TRUE;
+}
+
+static gboolean deepin_dbus_service_handle_get_surface_cache_stats (
+        DeepinDBusWm *object,
+        GDBusMethodInvocation *invocation,
+        gpointer data)
+{
+    meta_verbose("%s\n", __func__);
+
+    GVariant* stats = deepin_window_surface_manager_get_stats ();
+    deepin_dbus_wm_complete_get_surface_cache_stats (object, invocation, stats);
+    return TRUE;
+}
+
+/* the pixels of surface in a sealed memfd, nobody can change them after */
+static int thumbnail_memfd (cairo_surface_t* surface, GError** error)
+{
+#ifdef HAVE_MEMFD_CREATE
+    cairo_surface_flush (surface);
+    const guchar* data = cairo_image_surface_get_data (surface);
+    gsize size = (gsize)cairo_image_surface_get_stride (surface) *
+        cairo_image_surface_get_height (surface);
+    gsize written = 0;
+
+    if (!data) {
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                "invalid thumbnail");
+        return -1;
+    }
+
+    int fd = memfd_create ("deepin-wm-thumbnail", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        goto failed;
+
+    while (written < size) {
+        ssize_t n = write (fd, data + written, size - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            goto failed;
+        }
+        written += n;
+    }
+
+    if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+        goto failed;
+
+    return fd;
+
+failed:
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+            "thumbnail memfd: %s", g_strerror (errno));
+    if (fd >= 0) close (fd);
+    return -1;
+#else
+    g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+            "built without memfd support");
+    return -1;
+#endif
+}
+
+typedef struct _ThumbnailRequest
+{
+    DeepinDBusWm* object;
+    GDBusMethodInvocation* invocation;
+} ThumbnailRequest;
+
+static void on_thumbnail_ready (GObject* source, GAsyncResult* res,
+        gpointer data)
+{
+    ThumbnailRequest* req = (ThumbnailRequest*)data;
+    GError* error = NULL;
+    int fd = -1;
+
+    cairo_surface_t* surface = deepin_window_surface_manager_get_surface_finish (
+            res, &error);
+    if (surface)
+        fd = thumbnail_memfd (surface, &error);
+
+    if (fd < 0) {
+        g_dbus_method_invocation_take_error (req->invocation, error);
+
+    } else {
+        /* the list owns fd from now on */
+        GUnixFDList* fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+        gboolean argb = cairo_image_surface_get_format (surface) == CAIRO_FORMAT_ARGB32;
+
+        deepin_dbus_wm_complete_get_window_thumbnail (req->object,
+                req->invocation, fd_list, g_variant_new_handle (0),
+                cairo_image_surface_get_width (surface),
+                cairo_image_surface_get_height (surface),
+                cairo_image_surface_get_stride (surface),
+                argb ? "argb32" : "rgb24");
+        g_object_unref (fd_list);
+    }
+
+    if (surface) cairo_surface_destroy (surface);
+    g_object_unref (req->object);
+    g_slice_free (ThumbnailRequest, req);
+}
+
+static gboolean deepin_dbus_service_handle_get_window_thumbnail (
+        DeepinDBusWm *object,
+        GDBusMethodInvocation *invocation,
+        GUnixFDList *fd_list,
+        guint xid,
+        gint width,
+        gint height,
+        gpointer data)
+{
+    meta_verbose("%s: 0x%x at %dx%d\n", __func__, xid, width, height);
+
+    MetaDisplay* display = meta_get_display();
+    MetaWindow* window = meta_display_lookup_x_window (display, xid);
+    MetaRectangle r;
+
+    if (window)
+        meta_window_get_outer_rect (window, &r);
+
+    if (!window || window->unmanaging || r.width <= 0 || r.height <= 0) {
+        g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                G_DBUS_ERROR_INVALID_ARGS, "no window 0x%x", xid);
+        return TRUE;
+    }
+
+    if (width <= 0 || height <= 0) {
+        g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                G_DBUS_ERROR_INVALID_ARGS, "invalid size %dx%d", width, height);
+        return TRUE;
+    }
+
+    /* fit into the box, never larger than the window itself */
+    gdouble scale = MIN ((gdouble)width / r.width, (gdouble)height / r.height);
+    scale = MIN (scale, 1.0);
+
+    g_hash_table_add (_thumbnail_windows, window);
+
+    ThumbnailRequest* req = g_slice_new (ThumbnailRequest);
+    req->object = g_object_ref (object);
+    req->invocation = invocation;
+    deepin_window_surface_manager_get_surface_async (window, scale, NULL,
+            on_thumbnail_ready, req);
+    return TRUE;
+}
+
+static gboolean emit_thumbnails_changed (gpointer data)
+{
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init (&iter, _changed_thumbnails);
+    while (g_hash_table_iter_next (&iter, &key, NULL))
+        deepin_dbus_wm_emit_window_thumbnail_changed (_the_service,
+                GPOINTER_TO_UINT (key));
+
+    g_hash_table_remove_all (_changed_thumbnails);
+    _thumbnail_changed_id = 0;
+    return FALSE;
+}
+
+/* tell the clients about damage at a limited rate so a ticking clock
+ * doesn't flood the bus. whether the window has a cached snapshot right
+ * now doesn't matter, a thumbnail was handed out already */
+static void on_window_damaged (DeepinMessageHub* hub, MetaWindow* window,
+        XRectangle* rects, int n, gpointer data)
+{
+    if (!g_hash_table_contains (_thumbnail_windows, window))
+        return;
+
+    g_hash_table_add (_changed_thumbnails, GUINT_TO_POINTER (window->xwindow));
+    if (!_thumbnail_changed_id)
+        _thumbnail_changed_id = g_timeout_add_full (G_PRIORITY_LOW,
+                THUMBNAIL_CHANGED_INTERVAL, emit_thumbnails_changed, NULL, NULL);
+}
+
+static void on_window_removed (DeepinMessageHub *hub, MetaWindow* window,
+        gpointer data)
+{
+    g_hash_table_remove (_thumbnail_windows, window);
+}
+
 static gboolean on_idle_startup (gpointer data)
 {
     deepin_message_hub_startup_ready ();
@@ -407,6 +624,12 @@ DeepinDBusWm* deepin_dbus_service_get()
                 deepin_dbus_service_handle_tile_active_window, NULL,
                 "signal::handle_begin_to_move_active_window",
                 deepin_dbus_service_handle_begin_to_move_active_window, NULL,
+                "signal::handle_get_frame_stats",
+                deepin_dbus_service_handle_get_frame_stats, NULL,
+                "signal::handle_get_surface_cache_stats",
+                deepin_dbus_service_handle_get_surface_cache_stats, NULL,
+                "signal::handle_get_window_thumbnail",
+                deepin_dbus_service_handle_get_window_thumbnail, NULL,
                 NULL);
 
         g_object_connect (G_OBJECT(deepin_message_hub_get ()),
@@ -416,6 +639,14 @@ DeepinDBusWm* deepin_dbus_service_get()
                 "signal::startup-ready", on_startup_ready, _the_service,
                 NULL);
 
+        _thumbnail_windows = g_hash_table_new (g_direct_hash, g_direct_equal);
+        _changed_thumbnails = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+        g_object_connect (G_OBJECT(deepin_message_hub_get ()),
+                "signal::window-removed", on_window_removed, NULL,
+                "signal::window-damaged", on_window_damaged, NULL,
+                NULL);
+
         g_bus_own_name(G_BUS_TYPE_SESSION, 
                 "com.deepin.wm",
                 G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT|G_BUS_NAME_OWNER_FLAGS_REPLACE,
@@ -103,7 +103,7 @@ void deepin_message_hub_window_damaged(MetaWindow* window, XRectangle* rects, in
         return;
 
     g_signal_emit(deepin_message_hub_get(),
-            signals[SIGNAL_WINDOW_DAMAGED], 0, window);
+            signals[SIGNAL_WINDOW_DAMAGED], 0, window, rects, n);
 }
 
 void deepin_message_hub_desktop_changed(void)
@@ -162,11 +162,12 @@ static void deepin_message_hub_class_init (DeepinMessageHubClass *klass)
             NULL, NULL, NULL,
             G_TYPE_NONE, 1, G_TYPE_POINTER);
 
+    /* rects are in root coordinates, NULL means the whole window */
     signals[SIGNAL_WINDOW_DAMAGED] = g_signal_new ("window-damaged",
             G_OBJECT_CLASS_TYPE (klass),
             G_SIGNAL_RUN_LAST, 0,
             NULL, NULL, NULL,
-            G_TYPE_NONE, 1, G_TYPE_POINTER);
+            G_TYPE_NONE, 3, G_TYPE_POINTER, G_TYPE_POINTER, G_TYPE_INT);
 
     signals[SIGNAL_DESKTOP_CHANGED] = g_signal_new ("desktop-changed",
             G_OBJECT_CLASS_TYPE (klass),
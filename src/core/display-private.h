@@ -196,6 +196,7 @@ struct _MetaDisplay
   guint32     grab_motion_notify_time;
   int         grab_wireframe_last_display_width;
   int         grab_wireframe_last_display_height;
+  Window      grab_wireframe_xwindow;    /* Outline when not compositing */
   GList*      grab_old_window_stacking;
   MetaEdgeResistanceData *grab_edge_resistance_data;
   unsigned int grab_last_user_action_was_snap;
@@ -464,6 +464,7 @@ meta_display_open (void)
 
   the_display->grab_op = META_GRAB_OP_NONE;
   the_display->grab_wireframe_active = FALSE;
+  the_display->grab_wireframe_xwindow = None;
   the_display->grab_window = NULL;
   the_display->grab_screen = NULL;
   the_display->grab_resize_popup = NULL;
@@ -2269,7 +2270,7 @@ event_callback (XEvent   *event,
                               "Window %s withdrawn\n",
                               window->desc);
 
-                  /*meta_effect_run_close (window, NULL, NULL);*/
+                  meta_effect_run_close (window, NULL, NULL);
 
                   /* Unmanage withdrawn window */
                   window->withdrawn = TRUE;
@@ -3794,12 +3795,10 @@ meta_display_begin_grab_op (MetaDisplay *display,
                                           &display->grab_initial_window_pos);
       display->grab_anchor_window_pos = display->grab_initial_window_pos;
 
-#if 0
       display->grab_wireframe_active =
         (meta_prefs_get_reduced_resources () && !meta_prefs_get_gnome_accessibility ())  &&
         (meta_grab_op_is_resizing (display->grab_op) ||
          meta_grab_op_is_moving (display->grab_op));
-#endif
 
       if (display->grab_wireframe_active)
         {
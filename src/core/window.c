@@ -1597,12 +1597,11 @@ implement_showing (MetaWindow *window,
 
           meta_window_get_outer_rect (window, &window_rect);
 
-          finish_minimize (window);
-          /*meta_effect_run_minimize (window,*/
-                                    /*&window_rect,*/
-                                    /*&icon_rect,*/
-                                    /*finish_minimize,*/
-                                    /*window);*/
+          meta_effect_run_minimize (window,
+                                    &window_rect,
+                                    &icon_rect,
+                                    finish_minimize,
+                                    window);
         }
       else
         {
@@ -26,6 +26,13 @@
 #include "types.h"
 #include "boxes.h"
 
+typedef enum
+{
+  META_COMPOSITOR_EFFECT_MINIMIZE,
+  META_COMPOSITOR_EFFECT_UNMINIMIZE,
+  META_COMPOSITOR_EFFECT_CLOSE
+} MetaCompositorEffect;
+
 MetaCompositor *meta_compositor_new (MetaDisplay *display);
 void meta_compositor_destroy (MetaCompositor *compositor);
 
@@ -73,4 +80,19 @@ void meta_compositor_maximize_window   (MetaCompositor *compositor,
 void meta_compositor_unmaximize_window (MetaCompositor *compositor,
                                         MetaWindow     *window);
 
+GVariant *meta_compositor_get_frame_stats (MetaCompositor *compositor,
+                                           guint           since);
+void meta_compositor_set_show_redraw (MetaCompositor *compositor,
+                                      gboolean        show);
+gboolean meta_compositor_run_effect (MetaCompositor       *compositor,
+                                     MetaWindow           *window,
+                                     MetaCompositorEffect  effect,
+                                     MetaRectangle        *window_rect,
+                                     MetaRectangle        *icon_rect);
+gboolean meta_compositor_set_outline (MetaCompositor      *compositor,
+                                      MetaScreen          *screen,
+                                      const MetaRectangle *rect,
+                                      int                  cols,
+                                      int                  rows);
+
 #endif
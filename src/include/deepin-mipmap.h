@@ -0,0 +1,41 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+
+/**
+ * Copyright (C) 2016 Deepin Technology Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ **/
+
+#ifndef DEEPIN_MIPMAP_H
+#define DEEPIN_MIPMAP_H
+
+#include <stdint.h>
+#include <cairo.h>
+
+/*
+ * average of 2x2 premultiplied pixels, rounded to nearest. red/blue and
+ * alpha/green are summed two channels per 32 bit lane, so the loops
+ * using it vectorize without any arch specific code
+ */
+static inline uint32_t deepin_mipmap_box_filter4(uint32_t a, uint32_t b,
+        uint32_t c, uint32_t d)
+{
+    uint32_t rb = (a & 0xff00ff) + (b & 0xff00ff) + (c & 0xff00ff) +
+        (d & 0xff00ff) + 0x20002;
+    uint32_t ag = ((a >> 8) & 0xff00ff) + ((b >> 8) & 0xff00ff) +
+        ((c >> 8) & 0xff00ff) + ((d >> 8) & 0xff00ff) + 0x20002;
+
+    return ((rb >> 2) & 0xff00ff) | (((ag >> 2) & 0xff00ff) << 8);
+}
+
+/* draw src into a new width x height surface */
+cairo_surface_t* deepin_mipmap_scale(cairo_surface_t* src, int width, int height);
+
+/* next pyramid level: half the size of src (at least 1x1), 2x2 box
+ * filtered. an odd last row or column is left out */
+cairo_surface_t* deepin_mipmap_halve(cairo_surface_t* src);
+
+#endif
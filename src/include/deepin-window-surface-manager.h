@@ -47,9 +47,17 @@ GType deepin_window_surface_manager_get_type (void) G_GNUC_CONST;
 /* skeleton */
 DeepinWindowSurfaceManager* deepin_window_surface_manager_get(void);
 
-/* get surface from window at scale */
+/* get surface from window at scale, it belongs to the cache and stays
+ * valid at least until the main loop runs again */
 cairo_surface_t* deepin_window_surface_manager_get_surface(MetaWindow*, double);
 
+/* same as above, but new scales are built from a mipmap pyramid in a
+ * worker thread. finish returns a new reference to the surface */
+void deepin_window_surface_manager_get_surface_async(MetaWindow*, double,
+        GCancellable*, GAsyncReadyCallback, gpointer);
+cairo_surface_t* deepin_window_surface_manager_get_surface_finish(
+        GAsyncResult*, GError**);
+
 /* get combined surface of two windows, second is over first
  * the returned surafce inherit properties (format and size) of first parameter
  */
@@ -65,8 +73,21 @@ cairo_surface_t* deepin_window_surface_manager_get_combined3(
 /* clear surface for window */
 void deepin_window_surface_manager_remove_window(MetaWindow*);
 
-/* remove all caches inorder to get updated window preview */
-/* need better way, e.g automatic idle update */
+/* bytes of snapshots the cache may hold, 0 for no limit */
+void deepin_window_surface_manager_set_budget(gsize);
+
+/* seconds after which an unused 1.0 snapshot is kept compressed only,
+ * 0 to never compress */
+void deepin_window_surface_manager_set_cold_age(guint);
+
+/* a{sd} of cache counters: budget_bytes, resident_bytes, surfaces,
+ * windows, hits_total, misses_total, evictions_total, prewarm_pending,
+ * prewarmed_total, cold_snapshots, cold_bytes, compressed_total and
+ * decompressed_total */
+GVariant* deepin_window_surface_manager_get_stats(void);
+
+/* remove all caches inorder to get updated window preview,
+ * they get captured again in the background */
 void deepin_window_surface_manager_flush();
 
 G_END_DECLS
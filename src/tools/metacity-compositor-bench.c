@@ -0,0 +1,521 @@
+/* Metacity compositor benchmark client */
+
+/*
+ * Copyright (C) 2016 Deepin Technology Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Maps a set of synthetic windows (RGB and ARGB, plain and shaped),
+ * replays a damage/move/resize/restack trace on them and reports the
+ * frame statistics the compositor exports on com.deepin.wm.
+ *
+ * It is meant to be run on a private Xvfb display by
+ * run-compositor-bench.sh, see "make benchmark".
+ */
+
+#include <gio/gio.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/shape.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum
+{
+  ACTION_DAMAGE,
+  ACTION_MOVE,
+  ACTION_RESIZE,
+  ACTION_RESTACK,
+  ACTION_FRAME
+} ActionType;
+
+typedef struct
+{
+  ActionType type;
+  int window;
+  int x, y, width, height;
+} Action;
+
+typedef struct
+{
+  Window xwindow;
+  GC gc;
+  int depth;
+  int x, y, width, height;
+  gboolean shaped;
+} Client;
+
+static int n_clients = 16;
+static int n_steps = 600;
+static int rate = 60;
+static char *trace_name = "mixed";
+static char *trace_file = NULL;
+
+static GOptionEntry entries[] = {
+  { "clients", 'n', 0, G_OPTION_ARG_INT, &n_clients,
+    "Number of synthetic windows", "N" },
+  { "steps", 's', 0, G_OPTION_ARG_INT, &n_steps,
+    "Number of trace steps to replay", "N" },
+  { "rate", 'r', 0, G_OPTION_ARG_INT, &rate,
+    "Trace steps per second, 0 to replay as fast as possible", "N" },
+  { "trace", 't', 0, G_OPTION_ARG_STRING, &trace_name,
+    "Built-in trace: damage, move, resize, restack or mixed", "NAME" },
+  { "trace-file", 'f', 0, G_OPTION_ARG_FILENAME, &trace_file,
+    "Replay the trace in FILE instead of a built-in one", "FILE" },
+  { NULL }
+};
+
+static void
+create_client (Display *xdisplay,
+               Client  *client,
+               int      index)
+{
+  int screen = DefaultScreen (xdisplay);
+  XSetWindowAttributes attrs;
+  unsigned long mask;
+  XVisualInfo vinfo;
+  Visual *visual;
+  gboolean argb;
+
+  argb = (index % 2) == 1 &&
+         XMatchVisualInfo (xdisplay, screen, 32, TrueColor, &vinfo);
+
+  client->x = 40 + (index * 37) % 800;
+  client->y = 40 + (index * 53) % 500;
+  client->width = 320;
+  client->height = 240;
+  client->shaped = (index % 4) >= 2;
+
+  attrs.background_pixel = 0;
+  attrs.border_pixel = 0;
+  mask = CWBackPixel | CWBorderPixel;
+
+  if (argb)
+    {
+      visual = vinfo.visual;
+      client->depth = vinfo.depth;
+      attrs.colormap = XCreateColormap (xdisplay, RootWindow (xdisplay, screen),
+                                        visual, AllocNone);
+      mask |= CWColormap;
+    }
+  else
+    {
+      visual = DefaultVisual (xdisplay, screen);
+      client->depth = DefaultDepth (xdisplay, screen);
+    }
+
+  client->xwindow = XCreateWindow (xdisplay, RootWindow (xdisplay, screen),
+                                   client->x, client->y,
+                                   client->width, client->height, 0,
+                                   client->depth, InputOutput, visual,
+                                   mask, &attrs);
+  client->gc = XCreateGC (xdisplay, client->xwindow, 0, NULL);
+
+  if (client->shaped)
+    {
+      XRectangle rects[2];
+
+      /* An L shape, enough to take the shaped code paths */
+      rects[0].x = 0;
+      rects[0].y = 0;
+      rects[0].width = client->width;
+      rects[0].height = client->height / 2;
+      rects[1].x = 0;
+      rects[1].y = client->height / 2;
+      rects[1].width = client->width / 2;
+      rects[1].height = client->height / 2;
+
+      XShapeCombineRectangles (xdisplay, client->xwindow, ShapeBounding,
+                               0, 0, rects, 2, ShapeSet, Unsorted);
+    }
+
+  XStoreName (xdisplay, client->xwindow, "compositor benchmark");
+  XMapWindow (xdisplay, client->xwindow);
+}
+
+static void
+paint_client (Display *xdisplay,
+              Client  *client,
+              int      x,
+              int      y,
+              int      width,
+              int      height)
+{
+  /* Any opaque colour will do, it only has to change every time */
+  XSetForeground (xdisplay, client->gc,
+                  0xff000000 | (guint32) g_random_int_range (0, 0xffffff));
+  XFillRectangle (xdisplay, client->xwindow, client->gc, x, y, width, height);
+}
+
+static GArray *
+build_trace (const char *name)
+{
+  GArray *trace = g_array_new (FALSE, TRUE, sizeof (Action));
+  gboolean mixed = strcmp (name, "mixed") == 0;
+  int step;
+
+  for (step = 0; step < n_steps; step++)
+    {
+      const char *kind = name;
+      Action action;
+      int i;
+
+      if (mixed)
+        {
+          static const char *kinds[] = { "damage", "damage", "move",
+                                         "resize", "restack" };
+          kind = kinds[step % G_N_ELEMENTS (kinds)];
+        }
+
+      memset (&action, 0, sizeof (action));
+
+      if (strcmp (kind, "damage") == 0)
+        {
+          /* Small strips all over, like terminals and progress bars */
+          for (i = 0; i < n_clients; i++)
+            {
+              action.type = ACTION_DAMAGE;
+              action.window = i;
+              action.x = 0;
+              action.y = (step * 8) % 240;
+              action.width = 320;
+              action.height = 8;
+              g_array_append_val (trace, action);
+            }
+        }
+      else if (strcmp (kind, "move") == 0)
+        {
+          action.type = ACTION_MOVE;
+          action.window = step % n_clients;
+          action.x = 40 + (step * 13) % 1200;
+          action.y = 40 + (step * 7) % 600;
+          g_array_append_val (trace, action);
+        }
+      else if (strcmp (kind, "resize") == 0)
+        {
+          action.type = ACTION_RESIZE;
+          action.window = step % n_clients;
+          action.width = 200 + (step * 11) % 400;
+          action.height = 150 + (step * 5) % 300;
+          g_array_append_val (trace, action);
+        }
+      else if (strcmp (kind, "restack") == 0)
+        {
+          action.type = ACTION_RESTACK;
+          action.window = step % n_clients;
+          g_array_append_val (trace, action);
+        }
+      else
+        {
+          g_printerr ("Unknown trace \"%s\"\n", name);
+          exit (1);
+        }
+
+      memset (&action, 0, sizeof (action));
+      action.type = ACTION_FRAME;
+      g_array_append_val (trace, action);
+    }
+
+  return trace;
+}
+
+/* Trace files have one action per line:
+ *
+ *   damage WINDOW X Y WIDTH HEIGHT
+ *   move WINDOW X Y
+ *   resize WINDOW WIDTH HEIGHT
+ *   restack WINDOW
+ *   frame
+ *
+ * Empty lines and lines starting with '#' are ignored.
+ */
+static GArray *
+load_trace (const char *filename)
+{
+  GArray *trace = g_array_new (FALSE, TRUE, sizeof (Action));
+  GError *error = NULL;
+  char *contents;
+  char **lines;
+  int i;
+
+  if (!g_file_get_contents (filename, &contents, NULL, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      exit (1);
+    }
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      char *line = g_strstrip (lines[i]);
+      char verb[16];
+      Action action;
+      int n;
+
+      if (*line == '\0' || *line == '#')
+        continue;
+
+      memset (&action, 0, sizeof (action));
+      n = sscanf (line, "%15s %d %d %d %d %d", verb, &action.window,
+                  &action.x, &action.y, &action.width, &action.height);
+
+      if (strcmp (verb, "damage") == 0 && n == 6)
+        action.type = ACTION_DAMAGE;
+      else if (strcmp (verb, "move") == 0 && n == 4)
+        action.type = ACTION_MOVE;
+      else if (strcmp (verb, "resize") == 0 && n == 4)
+        {
+          action.type = ACTION_RESIZE;
+          action.width = action.x;
+          action.height = action.y;
+        }
+      else if (strcmp (verb, "restack") == 0 && n == 2)
+        action.type = ACTION_RESTACK;
+      else if (strcmp (verb, "frame") == 0)
+        action.type = ACTION_FRAME;
+      else
+        {
+          g_printerr ("%s:%d: can't parse \"%s\"\n", filename, i + 1, line);
+          exit (1);
+        }
+
+      if (action.type != ACTION_FRAME &&
+          (action.window < 0 || action.window >= n_clients))
+        {
+          g_printerr ("%s:%d: no window %d\n", filename, i + 1, action.window);
+          exit (1);
+        }
+
+      g_array_append_val (trace, action);
+    }
+
+  g_strfreev (lines);
+  g_free (contents);
+
+  return trace;
+}
+
+static void
+replay_trace (Display *xdisplay,
+              Client  *clients,
+              GArray  *trace)
+{
+  gint64 step_time = rate > 0 ? G_USEC_PER_SEC / rate : 0;
+  gint64 next_step = g_get_monotonic_time ();
+  guint i;
+
+  for (i = 0; i < trace->len; i++)
+    {
+      Action *action = &g_array_index (trace, Action, i);
+      Client *client = &clients[action->window];
+
+      switch (action->type)
+        {
+        case ACTION_DAMAGE:
+          paint_client (xdisplay, client, action->x, action->y,
+                        action->width, action->height);
+          break;
+        case ACTION_MOVE:
+          XMoveWindow (xdisplay, client->xwindow, action->x, action->y);
+          break;
+        case ACTION_RESIZE:
+          XResizeWindow (xdisplay, client->xwindow,
+                         action->width, action->height);
+          paint_client (xdisplay, client, 0, 0, action->width, action->height);
+          break;
+        case ACTION_RESTACK:
+          XRaiseWindow (xdisplay, client->xwindow);
+          break;
+        case ACTION_FRAME:
+          XSync (xdisplay, False);
+          next_step += step_time;
+          if (next_step > g_get_monotonic_time ())
+            g_usleep (next_step - g_get_monotonic_time ());
+          break;
+        }
+    }
+
+  XSync (xdisplay, False);
+}
+
+/* Frame statistics of the frames painted after frames_total was @since */
+static GVariant *
+get_frame_stats (GDBusConnection *bus,
+                 guint            since)
+{
+  GVariant *reply, *stats;
+
+  reply = g_dbus_connection_call_sync (bus, "com.deepin.wm", "/com/deepin/wm",
+                                       "com.deepin.wm", "GetFrameStats",
+                                       g_variant_new ("(u)", since),
+                                       G_VARIANT_TYPE ("(a{sd})"),
+                                       G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+  if (reply == NULL)
+    return NULL;
+
+  g_variant_get (reply, "(@a{sd})", &stats);
+  g_variant_unref (reply);
+
+  return stats;
+}
+
+static double
+lookup_stat (GVariant   *stats,
+             const char *key)
+{
+  double value = 0;
+
+  g_variant_lookup (stats, key, "d", &value);
+  return value;
+}
+
+static void
+print_series (GVariant   *stats,
+              const char *name,
+              const char *label)
+{
+  char *p50 = g_strdup_printf ("%s_p50", name);
+  char *p90 = g_strdup_printf ("%s_p90", name);
+  char *p99 = g_strdup_printf ("%s_p99", name);
+  char *max = g_strdup_printf ("%s_max", name);
+
+  g_print ("  %-22s p50 %10.2f  p90 %10.2f  p99 %10.2f  max %10.2f\n", label,
+           lookup_stat (stats, p50), lookup_stat (stats, p90),
+           lookup_stat (stats, p99), lookup_stat (stats, max));
+
+  g_free (p50);
+  g_free (p90);
+  g_free (p99);
+  g_free (max);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GDBusConnection *bus;
+  GVariant *before, *after;
+  Display *xdisplay;
+  Client *clients;
+  GArray *trace;
+  unsigned long first_request;
+  gint64 start, elapsed;
+  double frames;
+  int i;
+
+  context = g_option_context_new ("- compositor benchmark client");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  if (n_clients < 1)
+    n_clients = 1;
+
+  xdisplay = XOpenDisplay (NULL);
+  if (xdisplay == NULL)
+    {
+      g_printerr ("Can't open display\n");
+      return 1;
+    }
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  if (bus == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  /* Give the window manager some time to come up and own its name */
+  for (i = 0; i < 100; i++)
+    {
+      before = get_frame_stats (bus, 0);
+      if (before != NULL)
+        break;
+      g_usleep (G_USEC_PER_SEC / 10);
+    }
+
+  if (before == NULL)
+    {
+      g_printerr ("com.deepin.wm isn't answering, is the compositor running?\n");
+      return 1;
+    }
+
+  trace = trace_file ? load_trace (trace_file) : build_trace (trace_name);
+
+  clients = g_new0 (Client, n_clients);
+  for (i = 0; i < n_clients; i++)
+    create_client (xdisplay, &clients[i], i);
+  for (i = 0; i < n_clients; i++)
+    paint_client (xdisplay, &clients[i], 0, 0,
+                  clients[i].width, clients[i].height);
+  XSync (xdisplay, False);
+
+  /* Let the maps and first paints settle before measuring */
+  g_usleep (G_USEC_PER_SEC / 2);
+  g_variant_unref (before);
+  before = get_frame_stats (bus, 0);
+
+  first_request = NextRequest (xdisplay);
+  start = g_get_monotonic_time ();
+
+  replay_trace (xdisplay, clients, trace);
+
+  /* Wait for the last frame to be painted */
+  g_usleep (G_USEC_PER_SEC / 10);
+  elapsed = g_get_monotonic_time () - start;
+
+  after = get_frame_stats (bus, (guint) lookup_stat (before, "frames_total"));
+  if (after == NULL)
+    {
+      g_printerr ("Lost the window manager during the run\n");
+      return 1;
+    }
+
+  frames = lookup_stat (after, "frames_total") -
+           lookup_stat (before, "frames_total");
+
+  g_print ("trace %s: %d windows, %u actions, %.2f s\n",
+           trace_file ? trace_file : trace_name, n_clients, trace->len,
+           elapsed / (double) G_USEC_PER_SEC);
+  g_print ("  frames                 %10.0f (%.1f fps, %.0f late)\n", frames,
+           frames * G_USEC_PER_SEC / elapsed,
+           lookup_stat (after, "late_frames_total") -
+           lookup_stat (before, "late_frames_total"));
+  g_print ("  client requests        %10lu\n",
+           NextRequest (xdisplay) - first_request);
+  /* The series only cover the frames of this run, or its last ones if
+     there were more than the compositor keeps */
+  g_print ("  last %.0f frames:\n", lookup_stat (after, "frames"));
+  print_series (after, "paint_time_ms", "paint time (ms)");
+  print_series (after, "damaged_area", "damaged area (px)");
+  print_series (after, "windows_painted", "windows painted");
+  print_series (after, "requests", "compositor requests");
+  g_print ("  %-22s %10.0f\n", "culled area (px)",
+           lookup_stat (after, "culled_area"));
+
+  g_variant_unref (before);
+  g_variant_unref (after);
+  g_array_unref (trace);
+  g_free (clients);
+  g_object_unref (bus);
+  XCloseDisplay (xdisplay);
+
+  return 0;
+}
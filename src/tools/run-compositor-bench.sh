@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Runs the compositor benchmark on a private Xvfb display.
+#
+# usage: run-compositor-bench.sh WM BENCH [BENCH OPTIONS...]
+#
+#   WM     the deepin-metacity binary to measure
+#   BENCH  the metacity-compositor-bench binary
+#
+# BENCH_DISPLAY (default :99) and BENCH_SCREEN (default 1920x1080x24)
+# pick the Xvfb display.  The window manager settings schema must be
+# installed or reachable through GSETTINGS_SCHEMA_DIR.
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 WM BENCH [BENCH OPTIONS...]" >&2
+    exit 1
+fi
+
+wm=$1
+bench=$2
+shift 2
+
+display=${BENCH_DISPLAY:-:99}
+screen=${BENCH_SCREEN:-1920x1080x24}
+
+Xvfb $display -screen 0 $screen -nolisten tcp \
+    +extension Composite +extension RANDR >/dev/null 2>&1 &
+xvfb_pid=$!
+trap 'kill $xvfb_pid 2>/dev/null' EXIT INT TERM
+
+# Wait for the server to accept connections
+tries=0
+until xdpyinfo -display $display >/dev/null 2>&1; do
+    tries=$((tries + 1))
+    if [ $tries -gt 50 ]; then
+        echo "Xvfb didn't start on $display" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+DISPLAY=$display GSETTINGS_BACKEND=memory \
+    dbus-run-session -- sh -c '
+        wm=$1; bench=$2; shift 2
+        "$wm" --replace --composite >/dev/null 2>&1 &
+        wm_pid=$!
+        "$bench" "$@"
+        status=$?
+        kill $wm_pid 2>/dev/null
+        wait $wm_pid 2>/dev/null
+        exit $status
+    ' sh "$wm" "$bench" "$@"
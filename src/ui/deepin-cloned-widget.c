@@ -50,6 +50,7 @@ typedef struct _MetaDeepinClonedWidgetPrivate
 
     MetaWindow* meta_window;
     cairo_surface_t* snapshot;
+    GCancellable* snapshot_cancellable; /* pending snapshot at real_size */
     cairo_surface_t* icon;
 
     GtkRequisition real_size;
@@ -159,6 +160,11 @@ static void meta_deepin_cloned_widget_dispose(GObject *object)
     MetaDeepinClonedWidgetPrivate* priv = self->priv;
 
     priv->meta_window = NULL;
+    if (priv->snapshot_cancellable) {
+        g_cancellable_cancel(priv->snapshot_cancellable);
+        g_clear_object(&priv->snapshot_cancellable);
+    }
+
     if (priv->snapshot) {
         g_clear_pointer(&priv->snapshot, cairo_surface_destroy);
     }
@@ -249,7 +255,7 @@ static gboolean meta_deepin_cloned_widget_draw (GtkWidget *widget, cairo_t* cr)
     if (priv->meta_window->unmanaging || !priv->snapshot) return TRUE;
 
     gdouble d = priv->blur_radius;
-    if (d > 0.0) {
+    if (d > 0.0 && !priv->snapshot_cancellable) {
         x = cairo_image_surface_get_width(priv->snapshot) / 2.0,
           y = cairo_image_surface_get_height(priv->snapshot) / 2.0;
 
@@ -271,8 +277,20 @@ static gboolean meta_deepin_cloned_widget_draw (GtkWidget *widget, cairo_t* cr)
     } else {
         x = cairo_image_surface_get_width(priv->snapshot) / 2.0,
           y = cairo_image_surface_get_height(priv->snapshot) / 2.0;
-        cairo_set_source_surface(cr, priv->snapshot, -x, -y);
-        cairo_paint_with_alpha(cr, alpha);
+
+        /* a snapshot of another size stands in until the right one is ready */
+        gdouble k = priv->real_size.width / (x * 2.0);
+        if (x > 0 && fabs(k - 1.0) > 0.01) {
+            cairo_save(cr);
+            cairo_scale(cr, k, k);
+            cairo_set_source_surface(cr, priv->snapshot, -x, -y);
+            cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
+            cairo_paint_with_alpha(cr, alpha);
+            cairo_restore(cr);
+        } else {
+            cairo_set_source_surface(cr, priv->snapshot, -x, -y);
+            cairo_paint_with_alpha(cr, alpha);
+        }
     }
 
     if (priv->icon) {
@@ -722,6 +740,32 @@ void meta_deepin_cloned_widget_set_blur_radius(MetaDeepinClonedWidget* self, gdo
     gtk_widget_queue_draw(GTK_WIDGET(self));
 }
 
+static void on_snapshot_ready(GObject* source, GAsyncResult* res,
+        gpointer data)
+{
+    MetaDeepinClonedWidget* self = META_DEEPIN_CLONED_WIDGET(data);
+    MetaDeepinClonedWidgetPrivate* priv = self->priv;
+    GError* error = NULL;
+
+    cairo_surface_t* surface = deepin_window_surface_manager_get_surface_finish(
+            res, &error);
+    if (surface) {
+        g_clear_pointer(&priv->snapshot, cairo_surface_destroy);
+        priv->snapshot = surface;
+        g_clear_object(&priv->snapshot_cancellable);
+        gtk_widget_queue_draw(GTK_WIDGET(self));
+
+    } else {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            meta_verbose("%s: %s\n", __func__, error->message);
+            g_clear_object(&priv->snapshot_cancellable);
+        }
+        g_error_free(error);
+    }
+
+    g_object_unref(self);
+}
+
 void meta_deepin_cloned_widget_set_size(MetaDeepinClonedWidget* self,
         gdouble width, gdouble height)
 {
@@ -730,10 +774,23 @@ void meta_deepin_cloned_widget_set_size(MetaDeepinClonedWidget* self,
     MetaRectangle r;
     meta_window_get_outer_rect(priv->meta_window, &r);
 
-    g_clear_pointer (&priv->snapshot, cairo_surface_destroy);
-    priv->snapshot = deepin_window_surface_manager_get_surface(
-            priv->meta_window, (double)width/r.width);
-    if (priv->snapshot) cairo_surface_reference(priv->snapshot);
+    if (priv->snapshot_cancellable) {
+        g_cancellable_cancel(priv->snapshot_cancellable);
+        g_clear_object(&priv->snapshot_cancellable);
+    }
+
+    /* keep showing the old snapshot, if there is none the full sized
+     * one is captured right away anyway */
+    if (!priv->snapshot) {
+        priv->snapshot = deepin_window_surface_manager_get_surface(
+                priv->meta_window, 1.0);
+        if (priv->snapshot) cairo_surface_reference(priv->snapshot);
+    }
+
+    priv->snapshot_cancellable = g_cancellable_new();
+    deepin_window_surface_manager_get_surface_async(priv->meta_window,
+            (double)width/r.width, priv->snapshot_cancellable,
+            on_snapshot_ready, g_object_ref(self));
 
     priv->real_size.width = width;
     priv->real_size.height = height;
@@ -0,0 +1,70 @@
+/* -*- Mode: C; indent-tabs-mode: nil; c-basic-offset: 4; tab-width: 4 -*-  */
+
+/**
+ * Copyright (C) 2016 Deepin Technology Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ **/
+
+#include <glib.h>
+#include "deepin-mipmap.h"
+
+cairo_surface_t* deepin_mipmap_scale(cairo_surface_t* src, int width, int height)
+{
+    int sw = cairo_image_surface_get_width(src);
+    int sh = cairo_image_surface_get_height(src);
+
+    cairo_surface_t* surface = cairo_image_surface_create(
+            cairo_image_surface_get_format(src), width, height);
+    if (sw <= 0 || sh <= 0) return surface;
+
+    cairo_t* cr = cairo_create(surface);
+    cairo_scale(cr, (double)width / sw, (double)height / sh);
+    cairo_set_source_surface(cr, src, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    return surface;
+}
+
+cairo_surface_t* deepin_mipmap_halve(cairo_surface_t* src)
+{
+    cairo_format_t format = cairo_image_surface_get_format(src);
+    int sw = cairo_image_surface_get_width(src);
+    int sh = cairo_image_surface_get_height(src);
+    int dw = MAX(sw / 2, 1), dh = MAX(sh / 2, 1);
+
+    if ((format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) ||
+            sw <= 0 || sh <= 0)
+        return deepin_mipmap_scale(src, dw, dh);
+
+    cairo_surface_t* dst = cairo_image_surface_create(format, dw, dh);
+    if (cairo_surface_status(dst) != CAIRO_STATUS_SUCCESS)
+        return dst;
+
+    const guchar* sdata = cairo_image_surface_get_data(src);
+    int sstride = cairo_image_surface_get_stride(src);
+    guchar* ddata = cairo_image_surface_get_data(dst);
+    int dstride = cairo_image_surface_get_stride(dst);
+
+    for (int y = 0; y < dh; y++) {
+        const guint32* r0 = (const guint32*)(sdata + MIN(2 * y, sh - 1) * sstride);
+        const guint32* r1 = (const guint32*)(sdata + MIN(2 * y + 1, sh - 1) * sstride);
+        guint32* d = (guint32*)(ddata + y * dstride);
+
+        if (sw == 1) {
+            d[0] = deepin_mipmap_box_filter4(r0[0], r0[0], r1[0], r1[0]);
+            continue;
+        }
+
+        for (int x = 0; x < dw; x++)
+            d[x] = deepin_mipmap_box_filter4(r0[2 * x], r0[2 * x + 1],
+                    r1[2 * x], r1[2 * x + 1]);
+    }
+
+    cairo_surface_mark_dirty(dst);
+    return dst;
+}
@@ -17,6 +17,11 @@
 #include <cairo/cairo-xlib.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/Xcomposite.h>
+#ifdef HAVE_XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 #include "errors.h"
 #include "../core/frame-private.h"
@@ -26,10 +31,27 @@
 #include "compositor.h"
 #include "deepin-design.h"
 #include "deepin-window-surface-manager.h"
+#include "deepin-mipmap.h"
 #include "deepin-message-hub.h"
 
 static DeepinWindowSurfaceManager* _the_manager = NULL;
 
+/* default bytes of snapshots kept around, see META_SURFACE_CACHE_BUDGET */
+#define SURFACE_CACHE_BUDGET (256 << 20)
+
+/* pre-warming of snapshots nobody asked for yet */
+#define PREWARM_DELAY 300000 /* us a queued window has to settle */
+#define PREWARM_INTERVAL 100 /* ms between two captures */
+#define PREWARM_INTERVAL_MAX 3200
+#define PREWARM_BUDGET 8000 /* us a capture may take before backing off */
+
+/* pending damage of a window is simplified to its extents beyond this */
+#define DAMAGE_MAX_RECTS 16
+
+/* 1.0 snapshots unused this long get compressed, see META_SURFACE_COLD_AGE */
+#define COLD_AGE 60 /* s */
+#define COLD_SWEEP_INTERVAL 5 /* s */
+
 /*
  * MetaWindow -> surface list
  *   windows[i] is a GTree, key is scale, value is surface 
@@ -37,8 +59,70 @@ static DeepinWindowSurfaceManager* _the_manager = NULL;
 struct _DeepinWindowSurfaceManagerPrivate
 {
     GHashTable* windows;
+
+    GQueue lru; /* CacheEntry links, most recently used first */
+    gsize resident; /* bytes held by cached surfaces */
+    gsize budget; /* 0 means unlimited */
+    guint evict_id;
+
+    GHashTable* damage; /* MetaWindow -> cairo_region_t not patched in yet */
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+
+    GHashTable* prewarm; /* MetaWindow -> time it was last damaged */
+    guint prewarm_id;
+    guint prewarm_interval;
+    guint64 prewarmed;
+
+    GHashTable* cold; /* MetaWindow -> ColdSnapshot replacing its 1.0 */
+    gsize cold_resident; /* compressed bytes */
+    gint64 cold_age; /* us, 0 keeps every snapshot uncompressed */
+    guint cold_sweep_id;
+    gboolean cold_job_running;
+    guint64 compressed;
+    guint64 decompressed;
+
+#ifdef HAVE_XSHM
+    int shm_state; /* -1 not probed yet, 0 unusable, 1 usable */
+    GList* shm_pool; /* idle ShmSegments, most recently released first */
+#endif
 };
 
+#ifdef HAVE_XSHM
+/* number of idle segments kept around for the next captures */
+#define SHM_POOL_SIZE 4
+
+/* a shared memory segment attached to the X server, the pixels of a
+ * window snapshot live in it for as long as the snapshot is cached */
+typedef struct _ShmSegment
+{
+    Display* xdisplay;
+    XShmSegmentInfo info;
+    gsize size;
+} ShmSegment;
+
+static cairo_user_data_key_t shm_segment_key;
+#endif
+
+/* the pixels of a 1.0 snapshot nobody used for a while, deflated */
+typedef struct _ColdSnapshot
+{
+    GBytes* data;
+    cairo_format_t format;
+    int width, height;
+    gint64 last_used;
+} ColdSnapshot;
+
+static void cold_snapshot_free(ColdSnapshot* cold)
+{
+    if (_the_manager)
+        _the_manager->priv->cold_resident -= g_bytes_get_size(cold->data);
+
+    g_bytes_unref(cold->data);
+    g_slice_free(ColdSnapshot, cold);
+}
+
 enum
 {
     SIGNAL_SURFACE_INVALID,
@@ -55,12 +139,81 @@ static void deepin_window_surface_manager_init (DeepinWindowSurfaceManager *self
 
     self->priv->windows = g_hash_table_new_full(g_direct_hash, g_direct_equal,
             NULL, (GDestroyNotify)g_tree_unref);
+
+    g_queue_init(&self->priv->lru);
+    self->priv->resident = 0;
+    self->priv->budget = SURFACE_CACHE_BUDGET;
+    self->priv->evict_id = 0;
+
+    self->priv->damage = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, (GDestroyNotify)cairo_region_destroy);
+    self->priv->hits = self->priv->misses = self->priv->evictions = 0;
+
+    self->priv->prewarm = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, g_free);
+    self->priv->prewarm_id = 0;
+    self->priv->prewarm_interval = PREWARM_INTERVAL;
+    self->priv->prewarmed = 0;
+
+    self->priv->cold = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, (GDestroyNotify)cold_snapshot_free);
+    self->priv->cold_resident = 0;
+    self->priv->cold_age = COLD_AGE * G_USEC_PER_SEC;
+    self->priv->cold_sweep_id = 0;
+    self->priv->cold_job_running = FALSE;
+    self->priv->compressed = self->priv->decompressed = 0;
+
+    const char* cold_age = g_getenv("META_SURFACE_COLD_AGE");
+    if (cold_age) {
+        self->priv->cold_age = g_ascii_strtoull(cold_age, NULL, 10) * G_USEC_PER_SEC;
+    }
+
+    const char* budget = g_getenv("META_SURFACE_CACHE_BUDGET");
+    if (budget) {
+        self->priv->budget = g_ascii_strtoull(budget, NULL, 10) << 20;
+    }
+    meta_verbose("%s: surface cache budget %" G_GSIZE_FORMAT " bytes\n",
+            __func__, self->priv->budget);
+
+#ifdef HAVE_XSHM
+    self->priv->shm_state = -1;
+    self->priv->shm_pool = NULL;
+#endif
 }
 
+#ifdef HAVE_XSHM
+static void shm_segment_free(ShmSegment* seg)
+{
+    XShmDetach(seg->xdisplay, &seg->info);
+    shmdt(seg->info.shmaddr);
+    g_slice_free(ShmSegment, seg);
+}
+#endif
+
 static void deepin_window_surface_manager_finalize (GObject *object)
 {
     DeepinWindowSurfaceManager* self = DEEPIN_WINDOW_SURFACE_MANAGER(object);
+    if (self->priv->evict_id) {
+        g_source_remove(self->priv->evict_id);
+        self->priv->evict_id = 0;
+    }
+    if (self->priv->prewarm_id) {
+        g_source_remove(self->priv->prewarm_id);
+        self->priv->prewarm_id = 0;
+    }
+    if (self->priv->cold_sweep_id) {
+        g_source_remove(self->priv->cold_sweep_id);
+        self->priv->cold_sweep_id = 0;
+    }
+    g_hash_table_unref(self->priv->prewarm);
+    g_hash_table_unref(self->priv->damage);
     g_hash_table_unref(self->priv->windows);
+    g_hash_table_unref(self->priv->cold);
+
+#ifdef HAVE_XSHM
+    g_list_free_full(self->priv->shm_pool, (GDestroyNotify)shm_segment_free);
+    self->priv->shm_pool = NULL;
+#endif
 
 	G_OBJECT_CLASS (deepin_window_surface_manager_parent_class)->finalize (object);
 }
@@ -90,6 +243,197 @@ static gint scale_compare(gconstpointer a, gconstpointer b, gpointer data)
     return 0;
 }
 
+/* a cached surface, linked into the LRU list shared by all windows */
+typedef struct _CacheEntry
+{
+    GList link;
+    MetaWindow* window;
+    double scale;
+    gsize size;
+    guint version; /* bumped whenever the pixels are patched */
+    guint readers; /* worker jobs reading the pixels right now */
+    gint64 last_used;
+    gint64 last_damaged;
+} CacheEntry;
+
+static cairo_user_data_key_t cache_entry_key;
+
+static void cold_schedule(DeepinWindowSurfaceManager* self);
+
+/* called when the surface leaves the cache or is destroyed */
+static void cache_entry_free(void* data)
+{
+    CacheEntry* entry = (CacheEntry*)data;
+
+    if (_the_manager) {
+        DeepinWindowSurfaceManagerPrivate* priv = _the_manager->priv;
+        g_queue_unlink(&priv->lru, &entry->link);
+        priv->resident -= entry->size;
+    }
+
+    g_slice_free(CacheEntry, entry);
+}
+
+/* value destroy notify of the per window trees */
+static void cache_surface_destroy(cairo_surface_t* surface)
+{
+    cairo_surface_set_user_data(surface, &cache_entry_key, NULL, NULL);
+    cairo_surface_destroy(surface);
+}
+
+static void cache_insert(DeepinWindowSurfaceManager* self, GTree* t,
+        MetaWindow* window, double scale, cairo_surface_t* surface)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    CacheEntry* entry = g_slice_new0(CacheEntry);
+    entry->link.data = entry;
+    entry->window = window;
+    entry->scale = scale;
+    entry->size = (gsize)cairo_image_surface_get_stride(surface) *
+        cairo_image_surface_get_height(surface);
+    entry->last_used = g_get_monotonic_time();
+
+    double* s = g_new(double, 1);
+    *s = scale;
+    g_tree_insert(t, s, surface);
+
+    g_queue_push_head_link(&priv->lru, &entry->link);
+    priv->resident += entry->size;
+    cairo_surface_set_user_data(surface, &cache_entry_key, entry,
+            cache_entry_free);
+
+    cold_schedule(self);
+}
+
+static void cache_touch(DeepinWindowSurfaceManager* self,
+        cairo_surface_t* surface)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+    CacheEntry* entry = (CacheEntry*)cairo_surface_get_user_data(surface,
+            &cache_entry_key);
+    if (!entry) return;
+
+    entry->last_used = g_get_monotonic_time();
+    g_queue_unlink(&priv->lru, &entry->link);
+    g_queue_push_head_link(&priv->lru, &entry->link);
+}
+
+static guint cache_version(cairo_surface_t* surface)
+{
+    CacheEntry* entry = (CacheEntry*)cairo_surface_get_user_data(surface,
+            &cache_entry_key);
+    return entry ? entry->version : 0;
+}
+
+static void cache_mark_patched(cairo_surface_t* surface)
+{
+    CacheEntry* entry = (CacheEntry*)cairo_surface_get_user_data(surface,
+            &cache_entry_key);
+    if (!entry) return;
+
+    entry->version++;
+}
+
+/* a worker reads surface until the matching cache_release, patches go
+ * into a copy meanwhile, see cache_unshare */
+static void cache_hold(cairo_surface_t* surface)
+{
+    CacheEntry* entry = (CacheEntry*)cairo_surface_get_user_data(surface,
+            &cache_entry_key);
+    if (entry) entry->readers++;
+}
+
+static void cache_release(cairo_surface_t* surface)
+{
+    CacheEntry* entry = (CacheEntry*)cairo_surface_get_user_data(surface,
+            &cache_entry_key);
+    if (entry && entry->readers) entry->readers--;
+}
+
+/* least recently used entry that may go, scaled copies before 1.0 */
+static CacheEntry* cache_find_victim(DeepinWindowSurfaceManager* self)
+{
+    CacheEntry* victim = NULL;
+
+    for (GList* l = self->priv->lru.tail; l; l = l->prev) {
+        CacheEntry* entry = (CacheEntry*)l->data;
+        if (entry->scale != 1.0) return entry;
+        if (!victim) victim = entry;
+    }
+
+    return victim;
+}
+
+/* drop the least recently used compressed snapshot */
+static gboolean cold_evict(DeepinWindowSurfaceManager* self)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+    MetaWindow* victim = NULL;
+    gint64 oldest = 0;
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, priv->cold);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        ColdSnapshot* cold = (ColdSnapshot*)value;
+        if (!victim || cold->last_used < oldest) {
+            victim = (MetaWindow*)key;
+            oldest = cold->last_used;
+        }
+    }
+
+    if (!victim) return FALSE;
+
+    meta_verbose("%s: drop compressed %s\n", __func__, victim->desc);
+    priv->evictions++;
+    g_hash_table_remove(priv->cold, victim);
+    return TRUE;
+}
+
+/* drop entries until the cache fits the budget again. scaled copies go
+ * first, then compressed snapshots and 1.0 snapshots last */
+static gboolean cache_evict_idle(gpointer data)
+{
+    DeepinWindowSurfaceManager* self = (DeepinWindowSurfaceManager*)data;
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    priv->evict_id = 0;
+    if (priv->budget == 0) return FALSE;
+
+    while (priv->resident + priv->cold_resident > priv->budget) {
+        CacheEntry* entry = cache_find_victim(self);
+        if ((!entry || entry->scale == 1.0) && cold_evict(self))
+            continue;
+        if (!entry) break;
+
+        GTree* t = (GTree*)g_hash_table_lookup(priv->windows, entry->window);
+        meta_verbose("%s: drop %s at scale %f (%" G_GSIZE_FORMAT " bytes)\n",
+                __func__, entry->window->desc, entry->scale, entry->size);
+
+        double scale = entry->scale;
+        priv->evictions++;
+        /* frees entry */
+        g_tree_remove(t, &scale);
+    }
+
+    return FALSE;
+}
+
+/* surfaces are handed out without a reference, they have to stay valid
+ * until the caller is done with them, so the cache is only trimmed once
+ * the main loop is idle again */
+static void cache_evict(DeepinWindowSurfaceManager* self)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    if (priv->budget == 0 || priv->evict_id ||
+            priv->resident + priv->cold_resident <= priv->budget)
+        return;
+
+    priv->evict_id = g_idle_add(cache_evict_idle, self);
+}
+
 static cairo_surface_t* get_window_surface_from_xlib(MetaWindow* window)
 {
     cairo_surface_t *surface;
@@ -117,182 +461,1401 @@ static cairo_surface_t* get_window_surface_from_xlib(MetaWindow* window)
     return surface;
 }
 
-cairo_surface_t* deepin_window_surface_manager_get_surface(MetaWindow* window,
-        double scale)
+#ifdef HAVE_XSHM
+static ShmSegment* shm_segment_new(DeepinWindowSurfaceManager* self,
+        MetaDisplay* display, gsize size)
 {
-    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    ShmSegment* seg = g_slice_new0(ShmSegment);
+    seg->xdisplay = display->xdisplay;
+    seg->size = size;
 
-    GTree* t = (GTree*)g_hash_table_lookup(self->priv->windows, window);
-    if (!t) {
-        t = g_tree_new_full(scale_compare, NULL, g_free, 
-                (GDestroyNotify)cairo_surface_destroy);
-        g_hash_table_insert(self->priv->windows, window, t);
+    seg->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (seg->info.shmid < 0) {
+        g_slice_free(ShmSegment, seg);
+        return NULL;
     }
 
-    double* s = g_new(double, 1);
-    *s = 1.0;
-    cairo_surface_t* ref = (cairo_surface_t*)g_tree_lookup(t, s);
-    if (!ref) {
-        if (window->display->compositor) {
-            ref = meta_compositor_get_window_surface(window->display->compositor, window);
-        } else {
-            ref = get_window_surface_from_xlib(window);
-        }
-        if (!ref) {
-            g_free(s);
-            return NULL;
-        }
+    seg->info.shmaddr = shmat(seg->info.shmid, NULL, 0);
+    if (seg->info.shmaddr == (char*)-1) {
+        shmctl(seg->info.shmid, IPC_RMID, NULL);
+        g_slice_free(ShmSegment, seg);
+        return NULL;
+    }
+    seg->info.readOnly = False;
 
-        MetaRectangle r, r2;
-        meta_window_get_input_rect(window, &r);
-        meta_window_get_outer_rect(window, &r2);
+    meta_error_trap_push(display);
+    XShmAttach(display->xdisplay, &seg->info);
+    XSync(display->xdisplay, False);
+    int error_code = meta_error_trap_pop_with_return(display, FALSE);
 
-        cairo_format_t format = CAIRO_FORMAT_RGB24;
-        if (window->depth == 32)
-            format = CAIRO_FORMAT_ARGB32;
+    /* the segment goes away once both sides have detached */
+    shmctl(seg->info.shmid, IPC_RMID, NULL);
 
-#ifdef HAVE_COMPOSITE_EXTENSIONS
-        XRenderPictFormat *render_fmt;
-        render_fmt = XRenderFindVisualFormat(window->display->xdisplay,
-                window->xvisual);
+    if (error_code != 0) {
+        /* most likely a remote display, don't try again */
+        meta_verbose("%s: XShmAttach failed (%d)\n", __func__, error_code);
+        self->priv->shm_state = 0;
+        shmdt(seg->info.shmaddr);
+        g_slice_free(ShmSegment, seg);
+        return NULL;
+    }
 
-        if (render_fmt && render_fmt->type == PictTypeDirect 
-                && render_fmt->direct.alphaMask)
-            format = CAIRO_FORMAT_ARGB32;
+    return seg;
+}
 
-#endif
+/* smallest idle segment that fits, or a new one */
+static ShmSegment* shm_segment_acquire(DeepinWindowSurfaceManager* self,
+        MetaDisplay* display, gsize size)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+    GList* best = NULL;
 
-        cairo_surface_t* ret = cairo_image_surface_create(format, 
-                r2.width, r2.height);
+    for (GList* l = priv->shm_pool; l; l = l->next) {
+        ShmSegment* seg = (ShmSegment*)l->data;
+        if (seg->size >= size &&
+                (!best || seg->size < ((ShmSegment*)best->data)->size))
+            best = l;
+    }
 
-        meta_error_trap_push (window->display);
+    if (best) {
+        ShmSegment* seg = (ShmSegment*)best->data;
+        priv->shm_pool = g_list_delete_link(priv->shm_pool, best);
+        return seg;
+    }
 
-        cairo_t* cr = cairo_create(ret);
-        cairo_set_source_surface(cr, ref, r.x - r2.x, r.y - r2.y);
-        cairo_paint(cr);
-        cairo_destroy(cr);
-        cairo_surface_destroy(ref);
+    size = (size + 4095) & ~(gsize)4095;
+    return shm_segment_new(self, display, size);
+}
 
-        int error_code = meta_error_trap_pop_with_return (window->display, FALSE);
-        if (error_code != 0) {
-            meta_warning ("draw surface error %d\n", error_code);
-            g_free(s);
-            cairo_surface_destroy(ret);
-            return NULL;
+static gboolean shm_segment_recycle(gpointer data)
+{
+    ShmSegment* seg = (ShmSegment*)data;
 
-        } else {
-            ref = ret;
-            meta_verbose("%s: clip visible rect\n", window->desc);
-            g_tree_insert(t, s, ref);
-        }
-    } else {
-        g_free(s);
+    if (!_the_manager) {
+        shm_segment_free(seg);
+        return FALSE;
     }
 
-    if (scale == 1.0) return ref;
-
-    cairo_surface_t* surface = (cairo_surface_t*)g_tree_lookup(t, &scale);
-    if (!surface) {
-        double width = cairo_image_surface_get_width(ref) * scale;
-        double height = cairo_image_surface_get_height(ref) * scale;
-        surface = cairo_image_surface_create(cairo_image_surface_get_format(ref),
-                width, height);
-        cairo_t* cr = cairo_create(surface);
-        cairo_scale(cr, scale, scale);
-        cairo_set_source_surface(cr, ref, 0, 0);
-        cairo_paint(cr);
-        cairo_destroy(cr);
+    DeepinWindowSurfaceManagerPrivate* priv = _the_manager->priv;
+    priv->shm_pool = g_list_prepend(priv->shm_pool, seg);
 
-        s = g_new(double, 1);
-        *s = scale;
-        g_tree_insert(t, s, surface);
-        meta_verbose("%s: (%s) new scale %f\n", __func__, window->desc, scale);
+    if (g_list_length(priv->shm_pool) > SHM_POOL_SIZE) {
+        GList* last = g_list_last(priv->shm_pool);
+        shm_segment_free((ShmSegment*)last->data);
+        priv->shm_pool = g_list_delete_link(priv->shm_pool, last);
     }
-    
-    return surface;
+
+    return FALSE;
 }
 
-cairo_surface_t* deepin_window_surface_manager_get_combined_surface(
-        MetaWindow* win1, MetaWindow* win2, int x, int y, double scale)
+/* called when a snapshot captured into seg is destroyed. the pool and
+ * the X connection belong to the main loop, a worker dropping the last
+ * reference hands the segment over to it */
+static void shm_segment_release(void* data)
 {
-    cairo_surface_t* surface1 = deepin_window_surface_manager_get_surface(win1, 1.0);
-    cairo_surface_t* surface2 = deepin_window_surface_manager_get_surface(win2, 1.0);
-
-    return deepin_window_surface_manager_get_combined3(
-            surface1, surface2, x, y, NULL, 0, 0, scale);
+    if (g_main_context_is_owner(g_main_context_default()))
+        shm_segment_recycle(data);
+    else
+        g_idle_add(shm_segment_recycle, data);
 }
+#endif
 
-cairo_surface_t* deepin_window_surface_manager_get_combined3(
-        cairo_surface_t* ref,
-        cairo_surface_t* surface1, int x1, int y1, 
-        cairo_surface_t* surface2, int x2, int y2, 
-        double scale)
+/*
+ * read (x, y, width, height) of the drawable behind ref straight into
+ * shared memory, and hand it out as an image surface over that memory.
+ * returns NULL whenever that can't be done, the caller then falls back
+ * to drawing ref into an image surface.
+ */
+static cairo_surface_t* capture_surface_with_shm(MetaDisplay* display,
+        cairo_surface_t* ref, cairo_format_t format,
+        int x, int y, int width, int height)
 {
-    if (!ref) return NULL;
+#ifdef HAVE_XSHM
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+    Display* xdisplay = display->xdisplay;
 
-    cairo_surface_t* ret = cairo_image_surface_create(
-            cairo_image_surface_get_format(ref),
-            cairo_image_surface_get_width(ref),
-            cairo_image_surface_get_height(ref));
+    if (priv->shm_state < 0) {
+        priv->shm_state = XShmQueryExtension(xdisplay) &&
+            g_getenv("META_DEBUG_NO_SHM") == NULL;
+        meta_verbose("%s: MIT-SHM capture %s\n", __func__,
+                priv->shm_state ? "enabled" : "disabled");
+    }
 
-    cairo_t *cr = cairo_create(ret);
-    if (scale < 1.0) cairo_scale(cr, scale, scale);
+    if (!priv->shm_state || width <= 0 || height <= 0)
+        return NULL;
 
-    cairo_set_source_surface(cr, ref, 0, 0);
-    cairo_paint(cr);
+    if (cairo_surface_get_type(ref) != CAIRO_SURFACE_TYPE_XLIB)
+        return NULL;
 
-    if (surface1) {
-        cairo_set_source_surface(cr, surface1, x1, y1);
-        cairo_paint(cr);
+    Drawable drawable = cairo_xlib_surface_get_drawable(ref);
+    Visual* visual = cairo_xlib_surface_get_visual(ref);
+    int depth = cairo_xlib_surface_get_depth(ref);
+
+    if (drawable == None || visual == NULL)
+        return NULL;
+
+    /* the pixels have to be usable by cairo as they are */
+    if (visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 ||
+            visual->blue_mask != 0xff)
+        return NULL;
+    if (depth != 32 && (depth != 24 || format == CAIRO_FORMAT_ARGB32))
+        return NULL;
+
+    if (x < 0 || y < 0 ||
+            x + width > cairo_xlib_surface_get_width(ref) ||
+            y + height > cairo_xlib_surface_get_height(ref))
+        return NULL;
+
+    int stride = cairo_format_stride_for_width(format, width);
+    ShmSegment* seg = shm_segment_acquire(self, display, (gsize)stride * height);
+    /* out of shared memory for now, only this capture goes without */
+    if (!seg) return NULL;
+
+    XImage* image = XShmCreateImage(xdisplay, visual, depth, ZPixmap,
+            seg->info.shmaddr, &seg->info, width, height);
+    if (!image || image->bits_per_pixel != 32 || image->bytes_per_line != stride ||
+            image->byte_order != (G_BYTE_ORDER == G_LITTLE_ENDIAN ? LSBFirst : MSBFirst)) {
+        if (image) XDestroyImage(image);
+        shm_segment_release(seg);
+        return NULL;
     }
 
-    if (surface2) {
-        cairo_set_source_surface(cr, surface2, x2, y2);
-        cairo_paint(cr);
+    meta_error_trap_push(display);
+    Bool ok = XShmGetImage(xdisplay, drawable, image, x, y, AllPlanes);
+    int error_code = meta_error_trap_pop_with_return(display, FALSE);
+
+    /* only frees the XImage, the data belongs to the segment */
+    XDestroyImage(image);
+
+    if (!ok || error_code != 0) {
+        shm_segment_release(seg);
+        return NULL;
     }
-    cairo_destroy(cr);
 
-    return ret;
+    cairo_surface_t* surface = cairo_image_surface_create_for_data(
+            (unsigned char*)seg->info.shmaddr, format, width, height, stride);
+    if (cairo_surface_set_user_data(surface, &shm_segment_key, seg,
+                shm_segment_release) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        shm_segment_release(seg);
+        return NULL;
+    }
+
+    return surface;
+#else
+    return NULL;
+#endif
 }
 
-void deepin_window_surface_manager_remove_window(MetaWindow* window)
+/* the pyramid level (1/2^n) scale is derived from */
+static double mipmap_level(double scale)
 {
-    if (!window) return;
+    double level = 1.0;
+    while (level / 2.0 >= scale) level /= 2.0;
+    return level;
+}
 
-    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
-    if (g_hash_table_contains(self->priv->windows, window)) {
-        meta_verbose("%s: %s", __func__, window->desc);
-        g_hash_table_remove(self->priv->windows, window);
-        g_signal_emit(self, signals[SIGNAL_SURFACE_INVALID], 0, window);
+/* smallest cached level of t that is still at least scale */
+static cairo_surface_t* find_level(GTree* t, double scale, double* level_scale)
+{
+    double s = 1.0;
+    cairo_surface_t* best = (cairo_surface_t*)g_tree_lookup(t, &s);
+    *level_scale = 1.0;
+
+    while (s / 2.0 >= scale) {
+        s /= 2.0;
+        cairo_surface_t* level = (cairo_surface_t*)g_tree_lookup(t, &s);
+        if (level) {
+            best = level;
+            *level_scale = s;
+        }
     }
+
+    return best;
 }
 
-void deepin_window_surface_manager_flush()
+/* inflate cold into a new image surface, NULL if that fails */
+static cairo_surface_t* cold_inflate(ColdSnapshot* cold)
 {
-    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
-    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+    cairo_surface_t* surface = cairo_image_surface_create(cold->format,
+            cold->width, cold->height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
 
-    GList* l = g_hash_table_get_keys(self->priv->windows);
+    gsize in_size;
+    const guchar* in = (const guchar*)g_bytes_get_data(cold->data, &in_size);
+    guchar* out = cairo_image_surface_get_data(surface);
+    gsize out_size = (gsize)cairo_image_surface_get_stride(surface) * cold->height;
+    gsize in_off = 0, out_off = 0;
+    GConverterResult res;
 
-    for (GList* t = l; t; t = t->next) {
-        MetaWindow* win = (MetaWindow*)t->data;
-        g_hash_table_remove(priv->windows, win);
-        g_signal_emit(self, signals[SIGNAL_SURFACE_INVALID], 0, win);
-        deepin_window_surface_manager_get_surface((MetaWindow*)t->data, 1.0);
+    GConverter* z = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW));
+    do {
+        gsize nread = 0, nwritten = 0;
+        res = g_converter_convert(z, in + in_off, in_size - in_off,
+                out + out_off, out_size - out_off, G_CONVERTER_INPUT_AT_END,
+                &nread, &nwritten, NULL);
+        in_off += nread;
+        out_off += nwritten;
+    } while (res == G_CONVERTER_CONVERTED);
+    g_object_unref(z);
+
+    if (res != G_CONVERTER_FINISHED || out_off != out_size) {
+        cairo_surface_destroy(surface);
+        return NULL;
     }
-    g_list_free(l);
+
+    cairo_surface_mark_dirty(surface);
+    return surface;
 }
 
-static void on_window_removed(DeepinMessageHub* hub, MetaWindow* window, 
-        gpointer data)
+typedef struct _MipmapJob
 {
-    deepin_window_surface_manager_remove_window(window);
+    MetaWindow* window;
+    double scale;
+    int width, height; /* of the result */
+
+    cairo_surface_t* source; /* cached level the pyramid grows from */
+    double source_scale;
+    guint source_version;
+    ColdSnapshot cold; /* source is inflated from this if it has data */
+
+    GPtrArray* levels; /* built by the worker, source_scale / 2, / 4 ... */
+} MipmapJob;
+
+/* drop the surfaces the job holds. runs on the main thread, the task
+ * and with it the job may be finalized in the worker */
+static void mipmap_job_release(MipmapJob* job)
+{
+    cairo_surface_destroy(job->source);
+    job->source = NULL;
+    g_ptr_array_set_size(job->levels, 0);
+    if (job->cold.data) {
+        g_bytes_unref(job->cold.data);
+        job->cold.data = NULL;
+    }
 }
 
-static void on_window_damaged(DeepinMessageHub* hub, MetaWindow* window, 
-        gpointer data)
+static void mipmap_job_free(MipmapJob* job)
 {
-    deepin_window_surface_manager_remove_window(window);
+    mipmap_job_release(job);
+    g_ptr_array_unref(job->levels);
+    g_slice_free(MipmapJob, job);
+}
+
+/* runs in a worker thread, touches nothing but the job */
+static void mipmap_job_run(GTask* task, gpointer source_object,
+        gpointer task_data, GCancellable* cancellable)
+{
+    MipmapJob* job = (MipmapJob*)task_data;
+    double target = mipmap_level(job->scale);
+
+    if (!job->source) {
+        job->source = cold_inflate(&job->cold);
+        if (!job->source) {
+            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "corrupted snapshot");
+            return;
+        }
+    }
+
+    cairo_surface_t* level = cairo_surface_reference(job->source);
+    double level_scale = job->source_scale;
+
+    while (level_scale / 2.0 >= target) {
+        if (g_task_return_error_if_cancelled(task)) {
+            cairo_surface_destroy(level);
+            return;
+        }
+
+        cairo_surface_t* half = deepin_mipmap_halve(level);
+        cairo_surface_destroy(level);
+        level = half;
+        level_scale /= 2.0;
+        g_ptr_array_add(job->levels, cairo_surface_reference(level));
+    }
+
+    cairo_surface_t* surface = level;
+    if (job->scale != level_scale) {
+        surface = deepin_mipmap_scale(level, job->width, job->height);
+        cairo_surface_destroy(level);
+    }
+
+    g_task_return_pointer(task, surface, (GDestroyNotify)cairo_surface_destroy);
+}
+
+/* back on the main thread: cache what the worker built and hand it out */
+static void mipmap_job_done(GObject* source_object, GAsyncResult* res,
+        gpointer data)
+{
+    DeepinWindowSurfaceManager* self = DEEPIN_WINDOW_SURFACE_MANAGER(source_object);
+    GTask* task = G_TASK(data);
+    MipmapJob* job = (MipmapJob*)g_task_get_task_data(G_TASK(res));
+    GError* error = NULL;
+
+    /* the worker is done reading the cached level */
+    if (!job->cold.data)
+        cache_release(job->source);
+
+    cairo_surface_t* surface = (cairo_surface_t*)g_task_propagate_pointer(
+            G_TASK(res), &error);
+    if (!surface) {
+        mipmap_job_release(job);
+        g_task_return_error(task, error);
+        g_object_unref(task);
+        return;
+    }
+
+    /* the window may be gone, or its snapshot patched or dropped while
+     * the worker ran, the result is then handed out but not cached */
+    GTree* t = (GTree*)g_hash_table_lookup(self->priv->windows, job->window);
+
+    if (t && job->cold.data) {
+        ColdSnapshot* cold = (ColdSnapshot*)g_hash_table_lookup(
+                self->priv->cold, job->window);
+        double s = 1.0;
+        if (cold && cold->data == job->cold.data && !g_tree_lookup(t, &s)) {
+            g_hash_table_remove(self->priv->cold, job->window);
+            self->priv->decompressed++;
+            cache_insert(self, t, job->window, 1.0,
+                    cairo_surface_reference(job->source));
+        }
+    }
+
+    if (t && g_tree_lookup(t, &job->source_scale) == job->source &&
+            cache_version(job->source) == job->source_version) {
+        double scale = job->source_scale;
+        for (guint i = 0; i < job->levels->len; i++) {
+            scale /= 2.0;
+            if (!g_tree_lookup(t, &scale))
+                cache_insert(self, t, job->window, scale, cairo_surface_reference(
+                            (cairo_surface_t*)g_ptr_array_index(job->levels, i)));
+        }
+
+        if (!g_tree_lookup(t, &job->scale))
+            cache_insert(self, t, job->window, job->scale,
+                    cairo_surface_reference(surface));
+
+        cache_evict(self);
+    }
+
+    mipmap_job_release(job);
+    g_task_return_pointer(task, surface, (GDestroyNotify)cairo_surface_destroy);
+    g_object_unref(task);
+}
+
+static GTree* window_tree(DeepinWindowSurfaceManager* self, MetaWindow* window)
+{
+    GTree* t = (GTree*)g_hash_table_lookup(self->priv->windows, window);
+    if (!t) {
+        t = g_tree_new_full(scale_compare, NULL, g_free, 
+                (GDestroyNotify)cache_surface_destroy);
+        g_hash_table_insert(self->priv->windows, window, t);
+    }
+    return t;
+}
+
+/* read the visible rect of window back into a new 1.0 snapshot */
+static cairo_surface_t* capture_window(DeepinWindowSurfaceManager* self,
+        GTree* t, MetaWindow* window)
+{
+    cairo_surface_t* ref;
+
+    /* whatever was damaged so far is part of the new snapshot */
+    g_hash_table_remove(self->priv->damage, window);
+
+    if (window->display->compositor) {
+        ref = meta_compositor_get_window_surface(window->display->compositor, window);
+    } else {
+        ref = get_window_surface_from_xlib(window);
+    }
+    if (!ref) {
+        return NULL;
+    }
+
+    MetaRectangle r, r2;
+    meta_window_get_input_rect(window, &r);
+    meta_window_get_outer_rect(window, &r2);
+
+    cairo_format_t format = CAIRO_FORMAT_RGB24;
+    if (window->depth == 32)
+        format = CAIRO_FORMAT_ARGB32;
+
+#ifdef HAVE_COMPOSITE_EXTENSIONS
+    XRenderPictFormat *render_fmt;
+    render_fmt = XRenderFindVisualFormat(window->display->xdisplay,
+            window->xvisual);
+
+    if (render_fmt && render_fmt->type == PictTypeDirect 
+            && render_fmt->direct.alphaMask)
+        format = CAIRO_FORMAT_ARGB32;
+
+#endif
+
+    cairo_surface_t* ret = capture_surface_with_shm(window->display, ref,
+            format, r2.x - r.x, r2.y - r.y, r2.width, r2.height);
+    if (ret) {
+        cairo_surface_destroy(ref);
+        ref = ret;
+        meta_verbose("%s: captured visible rect through shm\n", window->desc);
+        cache_insert(self, t, window, 1.0, ref);
+
+    } else {
+        ret = cairo_image_surface_create(format, r2.width, r2.height);
+
+        meta_error_trap_push (window->display);
+
+        cairo_t* cr = cairo_create(ret);
+        cairo_set_source_surface(cr, ref, r.x - r2.x, r.y - r2.y);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        cairo_surface_destroy(ref);
+
+        int error_code = meta_error_trap_pop_with_return (window->display, FALSE);
+        if (error_code != 0) {
+            meta_warning ("draw surface error %d\n", error_code);
+            cairo_surface_destroy(ret);
+            return NULL;
+
+        } else {
+            ref = ret;
+            meta_verbose("%s: clip visible rect\n", window->desc);
+            cache_insert(self, t, window, 1.0, ref);
+        }
+    }
+
+    return ref;
+}
+
+/* runs in a worker thread */
+static GBytes* cold_deflate(cairo_surface_t* surface, GError** error)
+{
+    const guchar* data = cairo_image_surface_get_data(surface);
+    gsize size = (gsize)cairo_image_surface_get_stride(surface) *
+        cairo_image_surface_get_height(surface);
+    GBytes* bytes = NULL;
+
+    /* snapshots are mostly flat areas, the fastest level does fine */
+    GConverter* z = G_CONVERTER(g_zlib_compressor_new(
+                G_ZLIB_COMPRESSOR_FORMAT_RAW, 1));
+    GOutputStream* mem = g_memory_output_stream_new_resizable();
+    GOutputStream* out = g_converter_output_stream_new(mem, z);
+
+    if (g_output_stream_write_all(out, data, size, NULL, NULL, error) &&
+            g_output_stream_close(out, NULL, error))
+        bytes = g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(mem));
+
+    g_object_unref(out);
+    g_object_unref(mem);
+    g_object_unref(z);
+    return bytes;
+}
+
+/* bring the compressed 1.0 snapshot of window back into the cache */
+static cairo_surface_t* cold_restore(DeepinWindowSurfaceManager* self,
+        GTree* t, MetaWindow* window)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    ColdSnapshot* cold = (ColdSnapshot*)g_hash_table_lookup(priv->cold, window);
+    if (!cold) return NULL;
+
+    cairo_surface_t* ref = cold_inflate(cold);
+    g_hash_table_remove(priv->cold, window);
+    if (!ref) {
+        meta_warning("%s: corrupted snapshot of %s\n", __func__, window->desc);
+        return NULL;
+    }
+
+    priv->decompressed++;
+    meta_verbose("%s: %s\n", __func__, window->desc);
+    cache_insert(self, t, window, 1.0, ref);
+    return ref;
+}
+
+typedef struct _ColdJob
+{
+    MetaWindow* window;
+    cairo_surface_t* surface; /* the 1.0 snapshot being compressed */
+    guint version;
+    gint64 last_used;
+} ColdJob;
+
+/* on the main thread, see mipmap_job_release */
+static void cold_job_release(ColdJob* job)
+{
+    cairo_surface_destroy(job->surface);
+    job->surface = NULL;
+}
+
+static void cold_job_free(ColdJob* job)
+{
+    cold_job_release(job);
+    g_slice_free(ColdJob, job);
+}
+
+static void cold_job_run(GTask* task, gpointer source_object,
+        gpointer task_data, GCancellable* cancellable)
+{
+    ColdJob* job = (ColdJob*)task_data;
+    GError* error = NULL;
+
+    GBytes* bytes = cold_deflate(job->surface, &error);
+    if (bytes)
+        g_task_return_pointer(task, bytes, (GDestroyNotify)g_bytes_unref);
+    else
+        g_task_return_error(task, error);
+}
+
+static gboolean prewarm_paused(MetaWindow* window);
+static void patch_pending_damage(DeepinWindowSurfaceManager* self,
+        MetaWindow* window);
+static void cold_job_done(GObject* source_object, GAsyncResult* res,
+        gpointer data);
+
+/* compress the least recently used 1.0 snapshot unused for cold_age */
+static void cold_start_job(DeepinWindowSurfaceManager* self)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    if (priv->cold_job_running || priv->cold_age == 0)
+        return;
+
+    gint64 now = g_get_monotonic_time();
+    CacheEntry* victim = NULL;
+
+    /* ordered by last use, the oldest is at the tail */
+    for (GList* l = priv->lru.tail; l; l = l->prev) {
+        CacheEntry* entry = (CacheEntry*)l->data;
+        if (now - entry->last_used < priv->cold_age) break;
+
+        /* busy windows would only be compressed to be dropped again */
+        if (entry->scale == 1.0 && now - entry->last_damaged >= priv->cold_age &&
+                !g_hash_table_contains(priv->damage, entry->window)) {
+            victim = entry;
+            break;
+        }
+    }
+
+    if (!victim || prewarm_paused(victim->window))
+        return;
+
+    GTree* t = (GTree*)g_hash_table_lookup(priv->windows, victim->window);
+    double s = 1.0;
+    cairo_surface_t* surface = (cairo_surface_t*)g_tree_lookup(t, &s);
+
+    ColdJob* job = g_slice_new0(ColdJob);
+    job->window = victim->window;
+    job->surface = cairo_surface_reference(surface);
+    job->version = victim->version;
+    job->last_used = victim->last_used;
+    cache_hold(surface);
+    cairo_surface_flush(surface);
+
+    priv->cold_job_running = TRUE;
+    GTask* task = g_task_new(self, NULL, cold_job_done, NULL);
+    g_task_set_task_data(task, job, (GDestroyNotify)cold_job_free);
+    g_task_run_in_thread(task, cold_job_run);
+    g_object_unref(task);
+}
+
+static void cold_job_done(GObject* source_object, GAsyncResult* res,
+        gpointer data)
+{
+    DeepinWindowSurfaceManager* self = DEEPIN_WINDOW_SURFACE_MANAGER(source_object);
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+    ColdJob* job = (ColdJob*)g_task_get_task_data(G_TASK(res));
+    GError* error = NULL;
+
+    priv->cold_job_running = FALSE;
+    cache_release(job->surface);
+
+    GBytes* bytes = (GBytes*)g_task_propagate_pointer(G_TASK(res), &error);
+    if (!bytes) {
+        meta_warning("%s: %s\n", __func__, error->message);
+        g_error_free(error);
+        cold_job_release(job);
+        return;
+    }
+
+    /* only if nobody used, patched or dropped the snapshot meanwhile */
+    GTree* t = (GTree*)g_hash_table_lookup(priv->windows, job->window);
+    CacheEntry* entry = (CacheEntry*)cairo_surface_get_user_data(job->surface,
+            &cache_entry_key);
+    double s = 1.0;
+    if (!t || g_tree_lookup(t, &s) != job->surface || !entry ||
+            entry->version != job->version || entry->last_used != job->last_used ||
+            g_hash_table_contains(priv->damage, job->window)) {
+        g_bytes_unref(bytes);
+        cold_job_release(job);
+        cold_start_job(self);
+        return;
+    }
+
+    ColdSnapshot* cold = g_slice_new0(ColdSnapshot);
+    cold->data = bytes;
+    cold->format = cairo_image_surface_get_format(job->surface);
+    cold->width = cairo_image_surface_get_width(job->surface);
+    cold->height = cairo_image_surface_get_height(job->surface);
+    cold->last_used = job->last_used;
+
+    meta_verbose("%s: %s %" G_GSIZE_FORMAT " -> %" G_GSIZE_FORMAT " bytes\n",
+            __func__, job->window->desc, entry->size, g_bytes_get_size(bytes));
+
+    g_hash_table_insert(priv->cold, job->window, cold);
+    priv->cold_resident += g_bytes_get_size(bytes);
+    priv->compressed++;
+
+    /* frees entry, the job may hold the last reference to the surface */
+    g_tree_remove(t, &s);
+    cold_job_release(job);
+
+    cold_start_job(self);
+}
+
+static gboolean cold_sweep(gpointer data)
+{
+    DeepinWindowSurfaceManager* self = (DeepinWindowSurfaceManager*)data;
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+    gint64 now = g_get_monotonic_time();
+    GList* stale = NULL;
+
+    for (GList* l = priv->lru.tail; l; l = l->prev) {
+        CacheEntry* entry = (CacheEntry*)l->data;
+        if (now - entry->last_used < priv->cold_age) break;
+        if (entry->scale != 1.0) stale = g_list_prepend(stale, entry);
+    }
+
+    /* old scaled copies are made again from the 1.0 snapshot if needed */
+    for (GList* l = stale; l; l = l->next) {
+        CacheEntry* entry = (CacheEntry*)l->data;
+        GTree* t = (GTree*)g_hash_table_lookup(priv->windows, entry->window);
+        double scale = entry->scale;
+        priv->evictions++;
+        /* frees entry */
+        g_tree_remove(t, &scale);
+    }
+    g_list_free(stale);
+
+    cold_start_job(self);
+
+    if (g_queue_is_empty(&priv->lru)) {
+        priv->cold_sweep_id = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void cold_schedule(DeepinWindowSurfaceManager* self)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    if (priv->cold_age == 0 || priv->cold_sweep_id)
+        return;
+
+    priv->cold_sweep_id = g_timeout_add_seconds_full(G_PRIORITY_LOW,
+            COLD_SWEEP_INTERVAL, cold_sweep, self, NULL);
+}
+
+cairo_surface_t* deepin_window_surface_manager_get_surface(MetaWindow* window,
+        double scale)
+{
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    patch_pending_damage(self, window);
+    GTree* t = window_tree(self, window);
+
+    cairo_surface_t* surface = (cairo_surface_t*)g_tree_lookup(t, &scale);
+    if (surface) {
+        priv->hits++;
+        cache_touch(self, surface);
+        return surface;
+    }
+    priv->misses++;
+
+    double s = 1.0;
+    cairo_surface_t* ref = (cairo_surface_t*)g_tree_lookup(t, &s);
+    if (!ref) {
+        ref = cold_restore(self, t, window);
+        if (!ref) ref = capture_window(self, t, window);
+        if (!ref) return NULL;
+    } else {
+        cache_touch(self, ref);
+    }
+
+    if (scale == 1.0) {
+        cache_evict(self);
+        return ref;
+    }
+
+    double level_scale;
+    cairo_surface_t* level = find_level(t, scale, &level_scale);
+    surface = deepin_mipmap_scale(level,
+            cairo_image_surface_get_width(ref) * scale,
+            cairo_image_surface_get_height(ref) * scale);
+
+    cache_insert(self, t, window, scale, surface);
+    meta_verbose("%s: (%s) new scale %f\n", __func__, window->desc, scale);
+
+    cache_evict(self);
+    return surface;
+}
+
+/* a popup showing snapshots is up, or the main loop is busy */
+static gboolean prewarm_paused(MetaWindow* window)
+{
+    MetaDisplay* display = window->display;
+    MetaScreen* screen = window->screen;
+
+    if (display->grab_op != META_GRAB_OP_NONE || screen->tab_popup ||
+            screen->ws_previewer || screen->exposing_windows_popup)
+        return TRUE;
+
+    return XPending(display->xdisplay) > 0;
+}
+
+static gboolean prewarm_tick(gpointer data);
+static void prewarm_queue(DeepinWindowSurfaceManager* self, MetaWindow* window);
+
+static void prewarm_schedule(DeepinWindowSurfaceManager* self)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    if (priv->prewarm_id || g_hash_table_size(priv->prewarm) == 0)
+        return;
+
+    priv->prewarm_id = g_timeout_add_full(G_PRIORITY_LOW,
+            priv->prewarm_interval, prewarm_tick, self, NULL);
+}
+
+/* capture the window that has been quiet longest, one per tick */
+static gboolean prewarm_tick(gpointer data)
+{
+    DeepinWindowSurfaceManager* self = (DeepinWindowSurfaceManager*)data;
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    priv->prewarm_id = 0;
+
+    MetaWindow* window = NULL;
+    gint64 oldest = 0;
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, priv->prewarm);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        gint64 queued = *(gint64*)value;
+        if (!window || queued < oldest) {
+            window = (MetaWindow*)key;
+            oldest = queued;
+        }
+    }
+
+    if (!window) return FALSE;
+
+    gint64 start = g_get_monotonic_time();
+    if (start - oldest < PREWARM_DELAY || prewarm_paused(window)) {
+        prewarm_schedule(self);
+        return FALSE;
+    }
+
+    g_hash_table_remove(priv->prewarm, window);
+
+    GTree* t = window_tree(self, window);
+    double s = 1.0;
+    gboolean cached = g_tree_lookup(t, &s) != NULL;
+
+    /* a full cache would only trade snapshots in use for this one */
+    if (!cached && priv->budget &&
+            priv->resident + priv->cold_resident >= priv->budget) {
+        prewarm_schedule(self);
+        return FALSE;
+    }
+
+    if (!window->unmanaging && !g_hash_table_contains(priv->cold, window) &&
+            (!cached || g_hash_table_contains(priv->damage, window))) {
+        if (cached) {
+            /* read the damage back now rather than when a popup asks */
+            patch_pending_damage(self, window);
+            if (!g_hash_table_contains(priv->windows, window))
+                prewarm_queue(self, window);
+        } else {
+            cairo_surface_t* ref = capture_window(self, t, window);
+            if (ref) {
+                priv->prewarmed++;
+                cache_evict(self);
+            }
+        }
+
+        /* back off while captures are expensive */
+        gint64 elapsed = g_get_monotonic_time() - start;
+        if (elapsed > PREWARM_BUDGET)
+            priv->prewarm_interval = MIN(priv->prewarm_interval * 2,
+                    PREWARM_INTERVAL_MAX);
+        else
+            priv->prewarm_interval = PREWARM_INTERVAL;
+
+        meta_verbose("%s: %s took %" G_GINT64_FORMAT "us, next in %ums\n",
+                __func__, window->desc, elapsed, priv->prewarm_interval);
+    }
+
+    prewarm_schedule(self);
+    return FALSE;
+}
+
+/* have the 1.0 snapshot of window captured, or its pending damage
+ * patched, in the background */
+static void prewarm_queue(DeepinWindowSurfaceManager* self, MetaWindow* window)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    if (window->unmanaging || window->type == META_WINDOW_DESKTOP)
+        return;
+
+    /* a window still being damaged hasn't settled yet */
+    gint64* queued = (gint64*)g_hash_table_lookup(priv->prewarm, window);
+    if (queued) {
+        *queued = g_get_monotonic_time();
+        return;
+    }
+
+    GTree* t = (GTree*)g_hash_table_lookup(priv->windows, window);
+    double s = 1.0;
+    if ((t && g_tree_lookup(t, &s) &&
+                !g_hash_table_contains(priv->damage, window)) ||
+            g_hash_table_contains(priv->cold, window))
+        return;
+
+    queued = g_new(gint64, 1);
+    *queued = g_get_monotonic_time();
+    g_hash_table_insert(priv->prewarm, window, queued);
+    prewarm_schedule(self);
+}
+
+void deepin_window_surface_manager_get_surface_async(MetaWindow* window,
+        double scale, GCancellable* cancellable,
+        GAsyncReadyCallback callback, gpointer user_data)
+{
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    GTask* task = g_task_new(self, cancellable, callback, user_data);
+    g_task_set_source_tag(task, deepin_window_surface_manager_get_surface_async);
+
+    patch_pending_damage(self, window);
+    GTree* t = (GTree*)g_hash_table_lookup(priv->windows, window);
+    cairo_surface_t* surface = t ? (cairo_surface_t*)g_tree_lookup(t, &scale) : NULL;
+    if (surface) {
+        priv->hits++;
+        cache_touch(self, surface);
+        g_task_return_pointer(task, cairo_surface_reference(surface),
+                (GDestroyNotify)cairo_surface_destroy);
+        g_object_unref(task);
+        return;
+    }
+
+    MipmapJob* job = g_slice_new0(MipmapJob);
+    job->window = window;
+    job->scale = scale;
+    job->levels = g_ptr_array_new_with_free_func(
+            (GDestroyNotify)cairo_surface_destroy);
+
+    double s = 1.0;
+    cairo_surface_t* ref = t ? (cairo_surface_t*)g_tree_lookup(t, &s) : NULL;
+    ColdSnapshot* cold = (ColdSnapshot*)g_hash_table_lookup(priv->cold, window);
+
+    if (!ref && cold && scale != 1.0) {
+        /* inflating is left to the worker as well */
+        priv->misses++;
+        job->cold = *cold;
+        g_bytes_ref(job->cold.data);
+        job->source_scale = 1.0;
+        job->width = cold->width * scale;
+        job->height = cold->height * scale;
+
+    } else {
+        /* reading the window back has to happen here, only scaling is
+         * left to the worker. a capture counts as the miss of this request */
+        if (ref) {
+            priv->misses++;
+            cache_touch(self, ref);
+        } else {
+            ref = deepin_window_surface_manager_get_surface(window, 1.0);
+            t = (GTree*)g_hash_table_lookup(priv->windows, window);
+        }
+
+        if (!ref || scale == 1.0) {
+            if (ref)
+                g_task_return_pointer(task, cairo_surface_reference(ref),
+                        (GDestroyNotify)cairo_surface_destroy);
+            else
+                g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        "no snapshot of %s", window->desc);
+            g_object_unref(task);
+            mipmap_job_free(job);
+            return;
+        }
+
+        job->width = cairo_image_surface_get_width(ref) * scale;
+        job->height = cairo_image_surface_get_height(ref) * scale;
+        job->source = cairo_surface_reference(find_level(t,
+                    mipmap_level(scale), &job->source_scale));
+        job->source_version = cache_version(job->source);
+        cache_hold(job->source);
+        cairo_surface_flush(job->source);
+    }
+
+    meta_verbose("%s: (%s) scale %f from level %f\n", __func__,
+            window->desc, scale, job->source_scale);
+
+    GTask* worker = g_task_new(self, cancellable, mipmap_job_done, task);
+    g_task_set_task_data(worker, job, (GDestroyNotify)mipmap_job_free);
+    g_task_run_in_thread(worker, mipmap_job_run);
+    g_object_unref(worker);
+}
+
+cairo_surface_t* deepin_window_surface_manager_get_surface_finish(
+        GAsyncResult* result, GError** error)
+{
+    g_return_val_if_fail(g_task_is_valid(result, _the_manager), NULL);
+    return (cairo_surface_t*)g_task_propagate_pointer(G_TASK(result), error);
+}
+
+cairo_surface_t* deepin_window_surface_manager_get_combined_surface(
+        MetaWindow* win1, MetaWindow* win2, int x, int y, double scale)
+{
+    cairo_surface_t* surface1 = deepin_window_surface_manager_get_surface(win1, 1.0);
+    cairo_surface_t* surface2 = deepin_window_surface_manager_get_surface(win2, 1.0);
+
+    return deepin_window_surface_manager_get_combined3(
+            surface1, surface2, x, y, NULL, 0, 0, scale);
+}
+
+cairo_surface_t* deepin_window_surface_manager_get_combined3(
+        cairo_surface_t* ref,
+        cairo_surface_t* surface1, int x1, int y1, 
+        cairo_surface_t* surface2, int x2, int y2, 
+        double scale)
+{
+    if (!ref) return NULL;
+
+    cairo_surface_t* ret = cairo_image_surface_create(
+            cairo_image_surface_get_format(ref),
+            cairo_image_surface_get_width(ref),
+            cairo_image_surface_get_height(ref));
+
+    cairo_t *cr = cairo_create(ret);
+    if (scale < 1.0) cairo_scale(cr, scale, scale);
+
+    cairo_set_source_surface(cr, ref, 0, 0);
+    cairo_paint(cr);
+
+    if (surface1) {
+        cairo_set_source_surface(cr, surface1, x1, y1);
+        cairo_paint(cr);
+    }
+
+    if (surface2) {
+        cairo_set_source_surface(cr, surface2, x2, y2);
+        cairo_paint(cr);
+    }
+    cairo_destroy(cr);
+
+    return ret;
+}
+
+void deepin_window_surface_manager_remove_window(MetaWindow* window)
+{
+    if (!window) return;
+
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    g_hash_table_remove(self->priv->cold, window);
+    g_hash_table_remove(self->priv->damage, window);
+    if (g_hash_table_contains(self->priv->windows, window)) {
+        meta_verbose("%s: %s", __func__, window->desc);
+        g_hash_table_remove(self->priv->windows, window);
+        g_signal_emit(self, signals[SIGNAL_SURFACE_INVALID], 0, window);
+    }
+}
+
+void deepin_window_surface_manager_flush()
+{
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    g_hash_table_remove_all(priv->cold);
+    g_hash_table_remove_all(priv->damage);
+    GList* l = g_hash_table_get_keys(self->priv->windows);
+
+    for (GList* t = l; t; t = t->next) {
+        MetaWindow* win = (MetaWindow*)t->data;
+        g_hash_table_remove(priv->windows, win);
+        g_signal_emit(self, signals[SIGNAL_SURFACE_INVALID], 0, win);
+        prewarm_queue(self, win);
+    }
+    g_list_free(l);
+}
+
+void deepin_window_surface_manager_set_budget(gsize bytes)
+{
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    self->priv->budget = bytes;
+    cache_evict(self);
+}
+
+void deepin_window_surface_manager_set_cold_age(guint seconds)
+{
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    priv->cold_age = (gint64)seconds * G_USEC_PER_SEC;
+    if (priv->cold_age == 0 && priv->cold_sweep_id) {
+        g_source_remove(priv->cold_sweep_id);
+        priv->cold_sweep_id = 0;
+    }
+
+    if (!g_queue_is_empty(&priv->lru))
+        cold_schedule(self);
+}
+
+GVariant* deepin_window_surface_manager_get_stats(void)
+{
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sd}"));
+    g_variant_builder_add(&builder, "{sd}", "budget_bytes",
+            (double)priv->budget);
+    g_variant_builder_add(&builder, "{sd}", "resident_bytes",
+            (double)priv->resident);
+    g_variant_builder_add(&builder, "{sd}", "surfaces",
+            (double)g_queue_get_length(&priv->lru));
+    g_variant_builder_add(&builder, "{sd}", "windows",
+            (double)g_hash_table_size(priv->windows));
+    g_variant_builder_add(&builder, "{sd}", "hits_total", (double)priv->hits);
+    g_variant_builder_add(&builder, "{sd}", "misses_total",
+            (double)priv->misses);
+    g_variant_builder_add(&builder, "{sd}", "evictions_total",
+            (double)priv->evictions);
+    g_variant_builder_add(&builder, "{sd}", "prewarm_pending",
+            (double)g_hash_table_size(priv->prewarm));
+    g_variant_builder_add(&builder, "{sd}", "prewarmed_total",
+            (double)priv->prewarmed);
+    g_variant_builder_add(&builder, "{sd}", "cold_snapshots",
+            (double)g_hash_table_size(priv->cold));
+    g_variant_builder_add(&builder, "{sd}", "cold_bytes",
+            (double)priv->cold_resident);
+    g_variant_builder_add(&builder, "{sd}", "compressed_total",
+            (double)priv->compressed);
+    g_variant_builder_add(&builder, "{sd}", "decompressed_total",
+            (double)priv->decompressed);
+
+    return g_variant_builder_end(&builder);
+}
+
+static void on_window_added(DeepinMessageHub* hub, MetaWindow* window,
+        gpointer data)
+{
+    prewarm_queue(deepin_window_surface_manager_get(), window);
+}
+
+static void on_window_removed(DeepinMessageHub* hub, MetaWindow* window, 
+        gpointer data)
+{
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    g_hash_table_remove(self->priv->prewarm, window);
+    deepin_window_surface_manager_remove_window(window);
+}
+
+static gboolean collect_busy(gpointer key, gpointer value, gpointer data)
+{
+    CacheEntry* entry = (CacheEntry*)cairo_surface_get_user_data(
+            (cairo_surface_t*)value, &cache_entry_key);
+    if (entry && entry->readers)
+        *(GSList**)data = g_slist_prepend(*(GSList**)data, entry);
+    return FALSE;
+}
+
+/* g_queue_insert_before_link() is only in glib 2.62 */
+static void cache_link_before(GQueue* queue, GList* sibling, GList* link)
+{
+    if (!sibling) {
+        g_queue_push_tail_link(queue, link);
+    } else if (!sibling->prev) {
+        g_queue_push_head_link(queue, link);
+    } else {
+        link->prev = sibling->prev;
+        link->next = sibling;
+        sibling->prev->next = link;
+        sibling->prev = link;
+        queue->length++;
+    }
+}
+
+/* swap the surfaces of t a worker is reading for copies that can be
+ * patched, the worker keeps the old pixels to itself */
+static void cache_unshare(DeepinWindowSurfaceManager* self, GTree* t)
+{
+    GSList* busy = NULL;
+    g_tree_foreach(t, collect_busy, &busy);
+
+    for (GSList* l = busy; l; l = l->next) {
+        CacheEntry* entry = (CacheEntry*)l->data;
+        MetaWindow* window = entry->window;
+        double scale = entry->scale;
+        gint64 last_used = entry->last_used;
+        gint64 last_damaged = entry->last_damaged;
+        /* only entry itself is freed by the swap below */
+        GList* sibling = entry->link.next;
+
+        cairo_surface_t* surface = (cairo_surface_t*)g_tree_lookup(t, &scale);
+        cairo_surface_t* copy = deepin_mipmap_scale(surface,
+                cairo_image_surface_get_width(surface),
+                cairo_image_surface_get_height(surface));
+
+        if (cairo_surface_status(copy) != CAIRO_STATUS_SUCCESS) {
+            cairo_surface_destroy(copy);
+            /* frees entry */
+            g_tree_remove(t, &scale);
+            continue;
+        }
+
+        /* replaces surface, frees entry */
+        cache_insert(self, t, window, scale, copy);
+
+        /* the copy takes the place of surface in the lru, the scans from
+         * its tail rely on last_used growing towards the head */
+        entry = (CacheEntry*)cairo_surface_get_user_data(copy, &cache_entry_key);
+        entry->last_used = last_used;
+        entry->last_damaged = last_damaged;
+        g_queue_unlink(&self->priv->lru, &entry->link);
+        cache_link_before(&self->priv->lru, sibling, &entry->link);
+    }
+
+    g_slist_free(busy);
+}
+
+typedef struct _SurfacePatch
+{
+    cairo_surface_t* ref;
+    cairo_region_t* damage; /* in coordinates of ref */
+} SurfacePatch;
+
+/* resample the damaged area of a cached scale from the patched 1.0 surface */
+static gboolean patch_scaled_surface(gpointer key, gpointer value, gpointer data)
+{
+    double scale = *(double*)key;
+    if (scale == 1.0) return FALSE;
+
+    SurfacePatch* patch = (SurfacePatch*)data;
+    cairo_t* cr = cairo_create((cairo_surface_t*)value);
+    cache_mark_patched((cairo_surface_t*)value);
+
+    int n = cairo_region_num_rectangles(patch->damage);
+    for (int i = 0; i < n; i++) {
+        cairo_rectangle_int_t r;
+        cairo_region_get_rectangle(patch->damage, i, &r);
+
+        /* round outwards, partly covered pixels need resampling too */
+        double x1 = floor(r.x * scale), y1 = floor(r.y * scale);
+        double x2 = ceil((r.x + r.width) * scale);
+        double y2 = ceil((r.y + r.height) * scale);
+        cairo_rectangle(cr, x1, y1, x2 - x1, y2 - y1);
+    }
+    cairo_clip(cr);
+
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_scale(cr, scale, scale);
+    cairo_set_source_surface(cr, patch->ref, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    return FALSE;
+}
+
+/*
+ * read back only the damaged area (coordinates of the snapshot) into the
+ * cached 1.0 surface of window and resample it into every other cached
+ * scale. returns FALSE if the snapshots can't be patched and must be
+ * dropped.
+ */
+static gboolean patch_window_surfaces(MetaWindow* window, GTree* t,
+        cairo_region_t* damage)
+{
+    MetaDisplay* display = window->display;
+
+    double s = 1.0;
+    cairo_surface_t* ref = (cairo_surface_t*)g_tree_lookup(t, &s);
+    if (!ref) return g_tree_nnodes(t) == 0;
+
+    if (!display->compositor) return FALSE;
+
+    MetaRectangle r, r2;
+    meta_window_get_input_rect(window, &r);
+    meta_window_get_outer_rect(window, &r2);
+
+    /* resized, everything has to be captured again */
+    if (cairo_image_surface_get_width(ref) != r2.width ||
+            cairo_image_surface_get_height(ref) != r2.height)
+        return FALSE;
+
+    if (cairo_region_is_empty(damage))
+        return TRUE;
+
+    cache_unshare(deepin_window_surface_manager_get(), t);
+    ref = (cairo_surface_t*)g_tree_lookup(t, &s);
+    if (!ref) return FALSE;
+
+    cairo_surface_t* src = meta_compositor_get_window_surface(
+            display->compositor, window);
+    if (!src)
+        return FALSE;
+
+    cairo_format_t format = cairo_image_surface_get_format(ref);
+    gboolean ok = TRUE;
+
+    cairo_t* cr = cairo_create(ref);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cache_mark_patched(ref);
+
+    int nrects = cairo_region_num_rectangles(damage);
+    for (int i = 0; i < nrects && ok; i++) {
+        cairo_rectangle_int_t d;
+        cairo_region_get_rectangle(damage, i, &d);
+
+        int sx = d.x + r2.x - r.x, sy = d.y + r2.y - r.y;
+        cairo_surface_t* part = capture_surface_with_shm(display, src,
+                format, sx, sy, d.width, d.height);
+
+        meta_error_trap_push(display);
+        if (!part)
+            part = cairo_surface_create_for_rectangle(src, sx, sy,
+                    d.width, d.height);
+
+        cairo_set_source_surface(cr, part, d.x, d.y);
+        cairo_rectangle(cr, d.x, d.y, d.width, d.height);
+        cairo_fill(cr);
+        cairo_surface_destroy(part);
+
+        int error_code = meta_error_trap_pop_with_return(display, FALSE);
+        if (error_code != 0) {
+            meta_warning("patch surface error %d\n", error_code);
+            ok = FALSE;
+        }
+    }
+
+    cairo_destroy(cr);
+    cairo_surface_destroy(src);
+
+    if (ok) {
+        SurfacePatch patch = { ref, damage };
+        g_tree_foreach(t, patch_scaled_surface, &patch);
+        meta_verbose("%s: (%s) patched %d rects\n", __func__,
+                window->desc, nrects);
+    }
+
+    return ok;
+}
+
+/* bring the cached snapshots of window up to date before handing them
+ * out, they are dropped if that can't be done */
+static void patch_pending_damage(DeepinWindowSurfaceManager* self,
+        MetaWindow* window)
+{
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    cairo_region_t* damage = (cairo_region_t*)g_hash_table_lookup(
+            priv->damage, window);
+    if (!damage) return;
+
+    cairo_region_reference(damage);
+    g_hash_table_remove(priv->damage, window);
+
+    GTree* t = (GTree*)g_hash_table_lookup(priv->windows, window);
+    if (t && !patch_window_surfaces(window, t, damage)) {
+        meta_verbose("%s: drop %s\n", __func__, window->desc);
+        g_hash_table_remove(priv->windows, window);
+    }
+
+    cairo_region_destroy(damage);
+}
+
+/* the damage is only read back once somebody asks for the snapshots */
+static void on_window_damaged(DeepinMessageHub* hub, MetaWindow* window,
+        XRectangle* rects, int n, gpointer data)
+{
+    DeepinWindowSurfaceManager* self = deepin_window_surface_manager_get();
+    DeepinWindowSurfaceManagerPrivate* priv = self->priv;
+
+    GTree* t = (GTree*)g_hash_table_lookup(priv->windows, window);
+
+    /* a compressed snapshot can't be patched, it is out of date now */
+    gboolean was_cold = g_hash_table_remove(priv->cold, window);
+
+    if (!t || g_tree_nnodes(t) == 0) {
+        if (was_cold)
+            g_signal_emit(self, signals[SIGNAL_SURFACE_INVALID], 0, window);
+        prewarm_queue(self, window);
+        return;
+    }
+
+    double s = 1.0;
+    cairo_surface_t* ref = (cairo_surface_t*)g_tree_lookup(t, &s);
+
+    /* all of it damaged, or nothing to patch the scaled copies from */
+    if (!rects || !ref) {
+        deepin_window_surface_manager_remove_window(window);
+        prewarm_queue(self, window);
+        return;
+    }
+
+    MetaRectangle r2;
+    meta_window_get_outer_rect(window, &r2);
+
+    cairo_region_t* damage = (cairo_region_t*)g_hash_table_lookup(
+            priv->damage, window);
+    if (!damage) {
+        damage = cairo_region_create();
+        g_hash_table_insert(priv->damage, window, damage);
+    }
+
+    for (int i = 0; i < n; i++) {
+        cairo_rectangle_int_t d = {
+            rects[i].x - r2.x, rects[i].y - r2.y,
+            rects[i].width, rects[i].height
+        };
+        cairo_region_union_rectangle(damage, &d);
+    }
+
+    cairo_rectangle_int_t bounds = {
+        0, 0,
+        cairo_image_surface_get_width(ref), cairo_image_surface_get_height(ref)
+    };
+    cairo_region_intersect_rectangle(damage, &bounds);
+
+    if (cairo_region_is_empty(damage)) {
+        g_hash_table_remove(priv->damage, window);
+        return;
+    }
+
+    /* a busy window would pile up rects, one readback of the extents is
+     * cheaper than many small ones */
+    if (cairo_region_num_rectangles(damage) > DAMAGE_MAX_RECTS) {
+        cairo_region_get_extents(damage, &bounds);
+        g_hash_table_insert(priv->damage, window,
+                cairo_region_create_rectangle(&bounds));
+    }
+
+    CacheEntry* entry = (CacheEntry*)cairo_surface_get_user_data(ref,
+            &cache_entry_key);
+    if (entry) entry->last_damaged = g_get_monotonic_time();
+
+    prewarm_queue(self, window);
+    g_signal_emit(self, signals[SIGNAL_SURFACE_INVALID], 0, window);
 }
 
 DeepinWindowSurfaceManager* deepin_window_surface_manager_get(void)
@@ -302,6 +1865,7 @@ DeepinWindowSurfaceManager* deepin_window_surface_manager_get(void)
                 DEEPIN_TYPE_WINDOW_SURFACE_MANAGER, NULL);
 
         g_object_connect(G_OBJECT(deepin_message_hub_get()), 
+                "signal::window-added", on_window_added, NULL,
                 "signal::window-removed", on_window_removed, NULL,
                 "signal::window-damaged", on_window_damaged, NULL,
                 NULL);
@@ -0,0 +1,230 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+
+/* Metacity mipmap test program */
+
+/*
+ * Copyright (C) 2016 Deepin Technology Co., Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "deepin-mipmap.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>      /* To initialize random seed */
+
+#define NUM_RANDOM_RUNS 100000
+
+static void
+init_random_ness (void)
+{
+  srand (time (NULL));
+}
+
+static guint32
+get_random_pixel (void)
+{
+  return ((guint32) (rand () & 0xffff) << 16) | (rand () & 0xffff);
+}
+
+/* The 2x2 average done one channel at a time, rounded to nearest */
+static guint32
+reference_average (guint32 a, guint32 b, guint32 c, guint32 d)
+{
+  guint32 result = 0;
+  int shift;
+
+  for (shift = 0; shift < 32; shift += 8)
+    {
+      guint32 sum = ((a >> shift) & 0xff) + ((b >> shift) & 0xff) +
+                    ((c >> shift) & 0xff) + ((d >> shift) & 0xff);
+      result |= ((sum + 2) / 4) << shift;
+    }
+
+  return result;
+}
+
+static void
+test_box_filter_rounding (void)
+{
+  /* Sums just below, at and above a multiple of four in every channel */
+  g_assert (deepin_mipmap_box_filter4 (0x01010101, 0, 0, 0) == 0);
+  g_assert (deepin_mipmap_box_filter4 (0x01010101, 0x01010101, 0, 0) ==
+            0x01010101);
+  g_assert (deepin_mipmap_box_filter4 (0x01010101, 0x01010101,
+                                       0x01010101, 0) == 0x01010101);
+  g_assert (deepin_mipmap_box_filter4 (0x02020202, 0x01010101, 0, 0) ==
+            0x01010101);
+
+  /* No channel may carry into its neighbour */
+  g_assert (deepin_mipmap_box_filter4 (0xffffffff, 0xffffffff,
+                                       0xffffffff, 0xffffffff) ==
+            0xffffffff);
+  g_assert (deepin_mipmap_box_filter4 (0xff00ff00, 0xff00ff00,
+                                       0xff00ff00, 0xff00ff00) ==
+            0xff00ff00);
+  g_assert (deepin_mipmap_box_filter4 (0x00ff00ff, 0x00ff00ff,
+                                       0x00ff00ff, 0x00ff00fe) ==
+            0x00ff00ff);
+
+  printf ("%s passed.\n", G_STRFUNC);
+}
+
+static void
+test_box_filter_random (void)
+{
+  int i;
+
+  for (i = 0; i < NUM_RANDOM_RUNS; i++)
+    {
+      guint32 a = get_random_pixel ();
+      guint32 b = get_random_pixel ();
+      guint32 c = get_random_pixel ();
+      guint32 d = get_random_pixel ();
+
+      g_assert (deepin_mipmap_box_filter4 (a, b, c, d) ==
+                reference_average (a, b, c, d));
+    }
+
+  printf ("%s passed.\n", G_STRFUNC);
+}
+
+static cairo_surface_t *
+new_random_surface (cairo_format_t format,
+                    int            width,
+                    int            height)
+{
+  cairo_surface_t *surface;
+  unsigned char *data;
+  int stride, x, y;
+
+  surface = cairo_image_surface_create (format, width, height);
+  g_assert (cairo_surface_status (surface) == CAIRO_STATUS_SUCCESS);
+
+  cairo_surface_flush (surface);
+  data = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      ((guint32 *) (data + y * stride))[x] = get_random_pixel ();
+
+  cairo_surface_mark_dirty (surface);
+  return surface;
+}
+
+static guint32
+get_pixel (cairo_surface_t *surface,
+           int              x,
+           int              y)
+{
+  unsigned char *data = cairo_image_surface_get_data (surface);
+  int stride = cairo_image_surface_get_stride (surface);
+
+  return ((guint32 *) (data + y * stride))[x];
+}
+
+/* Halves a width x height surface and checks every pixel against the
+   average of the 2x2 block it comes from. Blocks running past the last
+   row or column repeat it, which only happens for a single row or
+   column of pixels */
+static void
+check_halve (cairo_format_t format,
+             int            width,
+             int            height)
+{
+  cairo_surface_t *src, *dst;
+  int dw, dh, x, y;
+
+  src = new_random_surface (format, width, height);
+  dst = deepin_mipmap_halve (src);
+
+  dw = MAX (width / 2, 1);
+  dh = MAX (height / 2, 1);
+  g_assert (cairo_surface_status (dst) == CAIRO_STATUS_SUCCESS);
+  g_assert (cairo_image_surface_get_format (dst) == format);
+  g_assert (cairo_image_surface_get_width (dst) == dw);
+  g_assert (cairo_image_surface_get_height (dst) == dh);
+
+  for (y = 0; y < dh; y++)
+    for (x = 0; x < dw; x++)
+      {
+        int x0 = MIN (2 * x, width - 1), x1 = MIN (2 * x + 1, width - 1);
+        int y0 = MIN (2 * y, height - 1), y1 = MIN (2 * y + 1, height - 1);
+
+        g_assert (get_pixel (dst, x, y) ==
+                  reference_average (get_pixel (src, x0, y0),
+                                     get_pixel (src, x1, y0),
+                                     get_pixel (src, x0, y1),
+                                     get_pixel (src, x1, y1)));
+      }
+
+  cairo_surface_destroy (src);
+  cairo_surface_destroy (dst);
+}
+
+static void
+test_halve_sizes (void)
+{
+  static const int sizes[] = { 1, 2, 3, 4, 5, 7, 8, 33 };
+  guint i, j;
+
+  for (i = 0; i < G_N_ELEMENTS (sizes); i++)
+    for (j = 0; j < G_N_ELEMENTS (sizes); j++)
+      {
+        check_halve (CAIRO_FORMAT_ARGB32, sizes[i], sizes[j]);
+        check_halve (CAIRO_FORMAT_RGB24, sizes[i], sizes[j]);
+      }
+
+  printf ("%s passed.\n", G_STRFUNC);
+}
+
+static void
+test_halve_to_one_pixel (void)
+{
+  cairo_surface_t *surface;
+  int width = 1, height = 300;
+
+  /* Keeps halving a 1 pixel wide column, it never gets narrower */
+  surface = new_random_surface (CAIRO_FORMAT_ARGB32, width, height);
+  while (height > 1)
+    {
+      cairo_surface_t *half = deepin_mipmap_halve (surface);
+
+      height = MAX (height / 2, 1);
+      g_assert (cairo_image_surface_get_width (half) == 1);
+      g_assert (cairo_image_surface_get_height (half) == height);
+
+      cairo_surface_destroy (surface);
+      surface = half;
+    }
+  cairo_surface_destroy (surface);
+
+  printf ("%s passed.\n", G_STRFUNC);
+}
+
+int
+main (int argc, char **argv)
+{
+  init_random_ness ();
+
+  test_box_filter_rounding ();
+  test_box_filter_random ();
+  test_halve_sizes ();
+  test_halve_to_one_pixel ();
+
+  printf ("All tests passed.\n");
+  return 0;
+}